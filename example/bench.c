@@ -62,6 +62,9 @@
 #if PICOEV
 # include "picoev.h"
 picoev_loop* pe_loop;
+static int *pe_fds, *pe_events, *pe_dels;
+static picoev_handler **pe_callbacks;
+static void **pe_cb_args;
 #endif
 #if NATIVE
 # include "ev.h"
@@ -82,7 +85,7 @@ static struct ev_timer *evto;
 void
 read_cb(int fd, short which, void *arg)
 {
-	int idx = (int) arg, widx = idx + 1;
+	int idx = (int)(long) arg, widx = idx + 1;
 	u_char ch;
 
         if (timers)
@@ -152,18 +155,23 @@ run_once(void)
 	static struct timeval ta, ts, te, tv;
 
 	gettimeofday(&ta, NULL);
-	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
-	  if (native == 2) {
 #if PICOEV
-	    if (picoev_is_active(pe_loop, cp[0])) {
-	      picoev_del(pe_loop, cp[0]);
+	if (native == 2) {
+	  /* re-register all the pipes, in a batch */
+	  int ndels = 0;
+	  for (i = 0; i < num_pipes; i++) {
+	    if (picoev_is_active(pe_loop, pe_fds[i])) {
+	      pe_dels[ndels++] = pe_fds[i];
 	    }
-	    picoev_add(pe_loop, cp[0], PICOEV_READ, 10, cb_picoev, (void*)i);
 	    drand48();
-#else
-	    abort();
+	  }
+	  picoev_del_many(pe_loop, pe_dels, ndels);
+	  picoev_add_many(pe_loop, pe_fds, pe_events, 10, pe_callbacks,
+			  pe_cb_args, num_pipes);
+	} else
 #endif
-	  } else if (native)
+	for (cp = pipes, i = 0; i < num_pipes; i++, cp += 2) {
+	  if (native)
             {
 #if NATIVE
               if (ev_is_active (&evio [i]))
@@ -181,7 +189,7 @@ run_once(void)
           else
             {
 		event_del(&events[i]);
-		event_set(&events[i], cp[0], EV_READ | EV_PERSIST, read_cb, (void *) i);
+		event_set(&events[i], cp[0], EV_READ | EV_PERSIST, read_cb, (void *)(long) i);
                 tv.tv_sec  = 10.;
                 tv.tv_usec = drand48() * 1e6;
 		event_add(&events[i], timers ? &tv : 0);
@@ -298,7 +306,7 @@ main (int argc, char **argv)
           if (native) {
             ev_init (&evto [i], timer_cb);
             ev_init (&evio [i], read_thunk);
-            evio [i].data = (void *)i;
+            evio [i].data = (void *)(long)i;
           }
 #endif
 #ifdef USE_PIPES
@@ -311,6 +319,20 @@ main (int argc, char **argv)
 		}
 	}
 
+#if PICOEV
+	pe_fds = calloc(num_pipes, sizeof(int));
+	pe_events = calloc(num_pipes, sizeof(int));
+	pe_dels = calloc(num_pipes, sizeof(int));
+	pe_callbacks = calloc(num_pipes, sizeof(picoev_handler*));
+	pe_cb_args = calloc(num_pipes, sizeof(void*));
+	for (i = 0; i < num_pipes; i++) {
+	  pe_fds[i] = pipes[i * 2];
+	  pe_events[i] = PICOEV_READ;
+	  pe_callbacks[i] = cb_picoev;
+	  pe_cb_args[i] = (void*)(long)i;
+	}
+#endif
+
 	for (i = 0; i < 2; i++) {
 		tv = run_once();
 	}
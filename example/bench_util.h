@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* helpers shared by the benchmarks built once per backend */
+
+#ifndef bench_util_h
+#define bench_util_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#ifndef PICOEV_BENCH_BACKEND
+# define PICOEV_BENCH_BACKEND "unknown"
+#endif
+#ifndef PICOEV_BENCH_VARIANT
+# define PICOEV_BENCH_VARIANT PICOEV_BENCH_BACKEND
+#endif
+
+/* wall clock time in secs */
+static inline double bench_now_sec(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* wall clock time in usecs */
+static inline double bench_now_usec(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+/* prints a CSV row of the format "backend,scenario,fds,run,usec,ops,
+   ops_per_sec" */
+static inline void bench_report(const char* backend, const char* scenario,
+				int fds, int run, double usec,
+				unsigned long long ops)
+{
+  printf("%s,%s,%d,%d,%.0f,%llu,%.2f\n", backend, scenario, fds, run, usec,
+	 ops, usec > 0 ? ops * 1000000.0 / usec : 0);
+  fflush(stdout);
+}
+
+/* CPU time (user and system) of the process in secs */
+static inline double bench_cpu_sec(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0
+    + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+/* sets the soft limit of the fds to n (only if it is lower when raise_only
+   is set), exiting on failure */
+static inline void bench_set_nofile(rlim_t n, int raise_only)
+{
+  struct rlimit rl;
+  getrlimit(RLIMIT_NOFILE, &rl);
+  if (raise_only && rl.rlim_cur >= n) {
+    return;
+  }
+  rl.rlim_cur = n;
+  if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+    perror("setrlimit");
+    exit(1);
+  }
+}
+
+/* raises the soft limit of the fds to n, or as far as permitted, returning
+   the resulting limit */
+static inline rlim_t bench_raise_nofile(rlim_t n)
+{
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+    return 0;
+  }
+  if (rl.rlim_cur < n) {
+    rl.rlim_cur = n < rl.rlim_max ? n : rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  return rl.rlim_cur;
+}
+
+#endif
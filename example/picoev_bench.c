@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Self-contained benchmark suite, printing one CSV row per measurement:
+ *
+ *   backend,scenario,fds,run,usec,ops,ops_per_sec
+ *
+ * usage: picoev_bench [-n num_pipes] [-a num_active] [-w num_writes]
+ *                     [-r runs] [-b backend] [scenario ...]
+ *
+ * -b selects the backend in builds with several of them
+ * (PICOEV_MULTI_BACKEND).
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+static int num_pipes = 1000, num_active = 1, num_writes = 1000, num_runs = 3;
+static const char* backend_name = PICOEV_BENCH_BACKEND;
+static int* pipes; /* pipes[i * 2] is read by the loop */
+static picoev_loop* loop;
+
+/* state of the ping chain */
+static int count, writes, fired, use_timeouts;
+
+static void nop_callback(picoev_loop* loop __attribute__((unused)),
+			 int fd __attribute__((unused)),
+			 int revents __attribute__((unused)),
+			 void* cb_arg __attribute__((unused)))
+{
+}
+
+static void unregister_all(void)
+{
+  int i;
+  for (i = 0; i < num_pipes; ++i) {
+    if (picoev_is_active(loop, pipes[i * 2])) {
+      picoev_del(loop, pipes[i * 2]);
+    }
+  }
+}
+
+/* ping chain, same as bench.c: each read forwards the byte to the next
+   pipe until num_writes bytes have been written */
+static void chain_callback(picoev_loop* loop, int fd, int revents,
+			   void* cb_arg)
+{
+  int widx = (int)(long)cb_arg + 1;
+  unsigned char ch;
+
+  if ((revents & PICOEV_TIMEOUT) != 0) {
+    return;
+  }
+  if (use_timeouts) {
+    picoev_set_timeout(loop, fd, 10);
+  }
+  count += read(fd, &ch, sizeof(ch));
+  if (writes != 0) {
+    if (widx >= num_pipes) {
+      widx -= num_pipes;
+    }
+    if (write(pipes[2 * widx + 1], "e", 1) != 1) {
+      abort();
+    }
+    --writes;
+    ++fired;
+  }
+}
+
+static void run_chain(const char* setup_name, const char* events_name,
+		      int run)
+{
+  int i, space;
+  double start, setup_end, end;
+
+  start = bench_now_usec();
+  for (i = 0; i < num_pipes; ++i) {
+    if (picoev_is_active(loop, pipes[i * 2])) {
+      picoev_del(loop, pipes[i * 2]);
+    }
+    picoev_add(loop, pipes[i * 2], PICOEV_READ, use_timeouts ? 10 : 0,
+	       chain_callback, (void*)(long)i);
+  }
+  picoev_loop_once(loop, 0);
+  setup_end = bench_now_usec();
+
+  fired = 0;
+  space = num_pipes / num_active * 2;
+  for (i = 0; i < num_active; ++i, ++fired) {
+    if (write(pipes[i * space + 1], "e", 1) != 1) {
+      abort();
+    }
+  }
+  count = 0;
+  writes = num_writes;
+  do {
+    picoev_loop_once(loop, 0);
+  } while (count != fired);
+  end = bench_now_usec();
+
+  bench_report(backend_name, setup_name, num_pipes * 2, run,
+	       setup_end - start, num_pipes);
+  bench_report(backend_name, events_name, num_pipes * 2, run,
+	       end - setup_end, count);
+}
+
+static void bench_chain(int run)
+{
+  use_timeouts = 0;
+  run_chain("chain_setup", "chain_events", run);
+}
+
+static void bench_chain_timeouts(int run)
+{
+  use_timeouts = 1;
+  run_chain("chain_timeouts_setup", "chain_timeouts_events", run);
+  use_timeouts = 0;
+}
+
+/* registers and unregisters every fd */
+static void bench_add_del(int run)
+{
+  int rounds = 10, r, i;
+  double start;
+
+  unregister_all();
+  start = bench_now_usec();
+  for (r = 0; r < rounds; ++r) {
+    for (i = 0; i < num_pipes; ++i) {
+      picoev_add(loop, pipes[i * 2], PICOEV_READ, 0, nop_callback, NULL);
+    }
+    picoev_loop_once(loop, 0);
+    for (i = 0; i < num_pipes; ++i) {
+      picoev_del(loop, pipes[i * 2]);
+    }
+  }
+  bench_report(backend_name, "add_del", num_pipes * 2, run,
+	       bench_now_usec() - start,
+	       (unsigned long long)rounds * num_pipes);
+}
+
+/* toggles the interest of every fd between read and read-write */
+static void bench_set_events(int run)
+{
+  int rounds = 10, r, i;
+  double start;
+
+  unregister_all();
+  for (i = 0; i < num_pipes; ++i) {
+    picoev_add(loop, pipes[i * 2], PICOEV_READ, 0, nop_callback, NULL);
+  }
+  start = bench_now_usec();
+  for (r = 0; r < rounds; ++r) {
+    for (i = 0; i < num_pipes; ++i) {
+      picoev_set_events(loop, pipes[i * 2],
+			r % 2 == 0 ? PICOEV_READWRITE : PICOEV_READ);
+    }
+  }
+  bench_report(backend_name, "set_events", num_pipes * 2, run,
+	       bench_now_usec() - start,
+	       (unsigned long long)rounds * num_pipes);
+  unregister_all();
+}
+
+/* updates the timeouts of random fds, as servers do on every request */
+static void run_timeout_churn(const char* name, int run, int lazy)
+{
+  unsigned long long n = 10000000, i;
+  unsigned x = 1;
+  double start;
+
+  unregister_all();
+  for (i = 0; i < (unsigned long long)num_pipes; ++i) {
+    picoev_add(loop, pipes[i * 2], PICOEV_READ, 30, nop_callback, NULL);
+  }
+  start = bench_now_usec();
+  for (i = 0; i < n; ++i) {
+    int fd;
+    x = x * 1103515245 + 12345;
+    fd = pipes[(x >> 8) % num_pipes * 2];
+    if (lazy) {
+      picoev_refresh_timeout(loop, fd, 30);
+    } else {
+      picoev_set_timeout(loop, fd, 30);
+    }
+  }
+  bench_report(backend_name, name, num_pipes * 2, run,
+	       bench_now_usec() - start, n);
+  unregister_all();
+}
+
+static void bench_timeout_churn(int run)
+{
+  run_timeout_churn("timeout_churn", run, 0);
+}
+
+static void bench_timeout_refresh(int run)
+{
+  run_timeout_churn("timeout_refresh", run, 1);
+}
+
+/* every fd times out at once, measures the time spent handling them */
+static int timeouts_fired;
+
+static void storm_callback(picoev_loop* loop, int fd, int revents,
+			   void* cb_arg __attribute__((unused)))
+{
+  if ((revents & PICOEV_TIMEOUT) != 0) {
+    ++timeouts_fired;
+    picoev_del(loop, fd);
+  }
+}
+
+static void bench_timeout_storm(int run)
+{
+  picoev_stats before, after;
+  int i;
+  double start, elapsed;
+
+  unregister_all();
+  for (i = 0; i < num_pipes; ++i) {
+    picoev_add(loop, pipes[i * 2], PICOEV_READ, 1, storm_callback, NULL);
+  }
+  timeouts_fired = 0;
+  picoev_loop_stats(loop, &before);
+  start = bench_now_usec();
+  while (timeouts_fired != num_pipes) {
+    picoev_loop_once(loop, 10);
+  }
+  picoev_loop_stats(loop, &after);
+  /* exclude the time spent waiting for the timeouts to become due */
+  elapsed = bench_now_usec() - start
+    - (after.blocked_nsec - before.blocked_nsec) / 1000.0;
+  bench_report(backend_name, "timeout_storm", num_pipes * 2, run, elapsed,
+	       timeouts_fired);
+}
+
+/* counts the wakeups of a loop with nothing to do but one timeout */
+static void bench_idle_wakeups(int run)
+{
+  picoev_stats before, after;
+  double start;
+
+  unregister_all();
+  picoev_add(loop, pipes[0], PICOEV_READ, 3, storm_callback, NULL);
+  timeouts_fired = 0;
+  picoev_loop_stats(loop, &before);
+  start = bench_now_usec();
+  while (timeouts_fired == 0) {
+    picoev_loop_once(loop, 60);
+  }
+  picoev_loop_stats(loop, &after);
+  bench_report(backend_name, "idle_wakeups", num_pipes * 2, run,
+	       bench_now_usec() - start,
+	       after.iterations - before.iterations);
+}
+
+static const struct {
+  const char* name;
+  void (*run)(int run);
+} scenarios[] = {
+  { "chain", bench_chain },
+  { "chain_timeouts", bench_chain_timeouts },
+  { "add_del", bench_add_del },
+  { "set_events", bench_set_events },
+  { "timeout_churn", bench_timeout_churn },
+  { "timeout_refresh", bench_timeout_refresh },
+  { "timeout_storm", bench_timeout_storm },
+  { "idle_wakeups", bench_idle_wakeups },
+  { NULL, NULL }
+};
+
+static void run_scenario(const char* name)
+{
+  int i, run;
+  for (i = 0; scenarios[i].name != NULL; ++i) {
+    if (strcmp(scenarios[i].name, name) == 0) {
+      for (run = 0; run < num_runs; ++run) {
+	(*scenarios[i].run)(run);
+      }
+      return;
+    }
+  }
+  fprintf(stderr, "unknown scenario: %s\n", name);
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  const char* backend = NULL;
+  int i, ch;
+
+  while ((ch = getopt(argc, argv, "n:a:w:r:b:")) != -1) {
+    switch (ch) {
+    case 'n':
+      num_writes = num_pipes = atoi(optarg);
+      break;
+    case 'a':
+      num_active = atoi(optarg);
+      break;
+    case 'w':
+      num_writes = atoi(optarg);
+      break;
+    case 'r':
+      num_runs = atoi(optarg);
+      break;
+    case 'b':
+      backend = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n num_pipes] [-a num_active]"
+	      " [-w num_writes] [-r runs] [-b backend] [scenario ...]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  bench_raise_nofile((rlim_t)num_pipes * 2 + 50);
+
+  picoev_init(num_pipes * 2 + 50);
+#ifdef PICOEV_MULTI_BACKEND
+  if (backend != NULL) {
+    const picoev_backend* b = picoev_find_backend(backend);
+    if (b == NULL) {
+      fprintf(stderr, "backend not available: %s\n", backend);
+      exit(1);
+    }
+    loop = picoev_create_loop_with_backend(b, 60);
+  } else {
+    loop = picoev_create_loop(60);
+  }
+  if (loop != NULL) {
+    static char name[64];
+    snprintf(name, sizeof(name), "%s+multi", loop->backend->name);
+    backend_name = name;
+  }
+#else
+  if (backend != NULL) {
+    fprintf(stderr, "-b requires a build with PICOEV_MULTI_BACKEND\n");
+    exit(1);
+  }
+  loop = picoev_create_loop(60);
+#endif
+  assert(loop != NULL);
+  if ((pipes = (int*)calloc(num_pipes * 2, sizeof(int))) == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+  for (i = 0; i < num_pipes; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pipes + i * 2) == -1) {
+      perror("socketpair");
+      exit(1);
+    }
+    fcntl(pipes[i * 2], F_SETFL, O_NONBLOCK);
+  }
+
+  printf("backend,scenario,fds,run,usec,ops,ops_per_sec\n");
+  if (argc == 0) {
+    for (i = 0; scenarios[i].name != NULL; ++i) {
+      run_scenario(scenarios[i].name);
+    }
+  } else {
+    for (i = 0; i < argc; ++i) {
+      run_scenario(argv[i]);
+    }
+  }
+
+  unregister_all();
+  picoev_destroy_loop(loop);
+  picoev_deinit();
+  return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the effect of the table allocator on a loop with a large number
+ * of fds, comparing the default allocator (huge pages) with
+ * plain calloc (the former behaviour). The select backend is used, whose
+ * picoev_add does not issue system calls, so that the fd slots can be
+ * registered without opening that many descriptors; the fds are then
+ * touched at random by picoev_set_timeout and picoev_get_callback, the way
+ * a busy server does.
+ *
+ * Prints one CSV row per run; dtlb_misses is -1 if perf events are not
+ * available, huge_kb is the amount of anonymous memory backed by
+ * transparent huge pages.
+ *
+ * usage: picoev_bench_alloc [-n num_fds] [-o num_ops] [-r runs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+#endif
+#include "picoev.h"
+#include "bench_util.h"
+
+#define BATCH 256 /* # of ops per latency sample */
+
+static int num_fds = 1024 * 1024, num_ops = 10000000, num_runs = 3;
+
+static void* calloc_alloc(size_t sz, int kind __attribute__((unused)),
+			  void* arg __attribute__((unused)))
+{
+  return calloc(1, sz);
+}
+
+static void calloc_free(void* p, size_t sz __attribute__((unused)),
+			int kind __attribute__((unused)),
+			void* arg __attribute__((unused)))
+{
+  free(p);
+}
+
+static void nop_callback(picoev_loop* loop __attribute__((unused)),
+			 int fd __attribute__((unused)),
+			 int revents __attribute__((unused)),
+			 void* cb_arg __attribute__((unused)))
+{
+}
+
+static int open_dtlb_counter(void)
+{
+#if defined(__linux__) && defined(SYS_perf_event_open)
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+  return -1;
+#endif
+}
+
+static long long read_counter(int fd)
+{
+  long long v;
+  if (fd == -1 || read(fd, &v, sizeof(v)) != sizeof(v)) {
+    return -1;
+  }
+  return v;
+}
+
+static long huge_kb(void)
+{
+  char line[256];
+  long kb, total = -1;
+  FILE* fp;
+  
+  if ((fp = fopen("/proc/self/smaps_rollup", "r")) == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+      total = kb;
+    }
+  }
+  fclose(fp);
+  return total;
+}
+
+static int cmp_double(const void* x, const void* y)
+{
+  double a = *(const double*)x, b = *(const double*)y;
+  return a < b ? -1 : a > b;
+}
+
+static void bench(const char* name, picoev_alloc_handler* alloc,
+		  picoev_free_handler* dealloc, int run)
+{
+  picoev_loop* loop;
+  unsigned long long rnd = 88172645463325252ULL;
+  int num_batches = num_ops / BATCH, i, j, counter;
+  double* samples, start, batch_start, usec;
+  long long misses;
+  long huge;
+  
+  if ((samples = (double*)malloc(sizeof(double) * num_batches)) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  picoev_set_allocator(alloc, dealloc, NULL);
+  if (picoev_init(num_fds) != 0
+      || (loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to initialize picoev\n");
+    exit(1);
+  }
+  /* register, and fault in the timeout slots used below */
+  for (i = 0; i < num_fds; ++i) {
+    picoev_add(loop, i, PICOEV_READ, 1 + i % 60, nop_callback, NULL);
+  }
+  huge = huge_kb();
+  
+  counter = open_dtlb_counter();
+  if (counter != -1) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  start = bench_now_usec();
+  for (i = 0; i < num_batches; ++i) {
+    batch_start = bench_now_usec();
+    for (j = 0; j < BATCH; ++j) {
+      int fd;
+      void* cb_arg;
+      rnd ^= rnd << 13;
+      rnd ^= rnd >> 7;
+      rnd ^= rnd << 17;
+      fd = (int)(rnd % num_fds);
+      picoev_set_timeout(loop, fd, 1 + (int)(rnd >> 32) % 60);
+      if (picoev_get_callback(loop, fd, &cb_arg) != nop_callback) {
+	abort();
+      }
+    }
+    samples[i] = (bench_now_usec() - batch_start) * 1000.0 / BATCH;
+  }
+  usec = bench_now_usec() - start;
+  if (counter != -1) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+  }
+  misses = read_counter(counter);
+  if (counter != -1) {
+    close(counter);
+  }
+  
+  qsort(samples, num_batches, sizeof(double), cmp_double);
+  printf("%s,%d,%d,%.0f,%d,%.2f,%.2f,%.2f,%lld,%ld\n", name, num_fds, run,
+	 usec, num_batches * BATCH, usec * 1000.0 / (num_batches * BATCH),
+	 samples[num_batches / 2], samples[num_batches * 99 / 100], misses,
+	 huge);
+  fflush(stdout);
+  
+  picoev_destroy_loop(loop);
+  picoev_deinit();
+  picoev_set_allocator(NULL, NULL, NULL);
+  free(samples);
+}
+
+int main(int argc, char** argv)
+{
+  int ch, run;
+
+  while ((ch = getopt(argc, argv, "n:o:r:")) != -1) {
+    switch (ch) {
+    case 'n':
+      num_fds = atoi(optarg);
+      break;
+    case 'o':
+      num_ops = atoi(optarg);
+      break;
+    case 'r':
+      num_runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n num_fds] [-o num_ops] [-r runs]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+  if (num_ops < BATCH * 100) {
+    num_ops = BATCH * 100;
+  }
+
+  printf("allocator,fds,run,usec,ops,ns_per_op,p50_ns,p99_ns,dtlb_misses,"
+	 "huge_kb\n");
+  for (run = 0; run < num_runs; ++run) {
+    bench("calloc", calloc_alloc, calloc_free, run);
+    bench("default", NULL, NULL, run);
+  }
+  return 0;
+}
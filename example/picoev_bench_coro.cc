@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares an echo server written with raw picoev callbacks and one written
+ * with coroutines (picoev_coro.hpp). Each of the -n connections is a
+ * socketpair whose client end, driven by a callback on the same loop, sends
+ * a message and waits for the echo; -a of them have a request in flight at
+ * any time. Prints CSV rows in the format of picoev_bench, ops being round
+ * trips.
+ *
+ * usage: picoev_bench_coro [-n num_conns] [-a num_active] [-r runs]
+ */
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#include "picoev_coro.hpp"
+#include "bench_util.h"
+
+#define MSG_SIZE 64
+
+static int num_conns = 1000, num_active = 100, num_runs = 3;
+static int num_round_trips = 1000000;
+static std::vector<int> fds; /* fds[i * 2] is the server end */
+static int count, writes;
+static char msg[MSG_SIZE];
+
+static void client_callback(picoev_loop*, int fd, int, void*)
+{
+  char buf[MSG_SIZE];
+  if (read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    abort();
+  }
+  ++count;
+  if (writes != 0) {
+    if (write(fd, msg, sizeof(msg)) != sizeof(msg)) {
+      abort();
+    }
+    --writes;
+  }
+}
+
+static void open_conns(picoev_loop* loop)
+{
+  fds.resize(num_conns * 2);
+  for (int i = 0; i < num_conns; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[i * 2]) != 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    fcntl(fds[i * 2], F_SETFL, O_NONBLOCK);
+    picoev_add(loop, fds[i * 2 + 1], PICOEV_READ, 0, client_callback, NULL);
+  }
+}
+
+/* sends the initial requests and runs the loop until all round trips are
+   done, then makes the servers see EOF */
+static void run(picoevpp::loop& loop, const char* scenario, int run_idx)
+{
+  count = 0;
+  writes = num_round_trips - num_active;
+  double start = bench_now_usec();
+  for (int i = 0; i < num_active; ++i) {
+    int fd = fds[i * (num_conns / num_active) * 2 + 1];
+    if (write(fd, msg, sizeof(msg)) != sizeof(msg)) {
+      abort();
+    }
+  }
+  while (count != num_round_trips) {
+    loop.loop_once(0);
+  }
+  bench_report(PICOEV_BENCH_BACKEND, scenario, num_conns * 2, run_idx,
+	       bench_now_usec() - start, count);
+  for (int i = 0; i < num_conns; ++i) {
+    picoev_del(loop.get(), fds[i * 2 + 1]);
+    close(fds[i * 2 + 1]);
+  }
+}
+
+/* raw callback server */
+static void echo_callback(picoev_loop* loop, int fd, int, void*)
+{
+  char buf[MSG_SIZE];
+  ssize_t r = read(fd, buf, sizeof(buf));
+  if (r > 0) {
+    if (write(fd, buf, r) != r) {
+      abort();
+    }
+  } else if (r == 0 || errno != EAGAIN) {
+    picoev_del(loop, fd);
+    close(fd);
+  }
+}
+
+static void bench_callback(picoevpp::loop& loop, int run_idx)
+{
+  open_conns(loop.get());
+  for (int i = 0; i < num_conns; ++i) {
+    picoev_add(loop.get(), fds[i * 2], PICOEV_READ, 0, echo_callback, NULL);
+  }
+  run(loop, "echo_callback", run_idx);
+  while (picoev_next_fd(loop.get(), -1) != -1) {
+    loop.loop_once(0);
+  }
+}
+
+/* coroutine server */
+static picoevpp::task echo_coro(picoevpp::coro_loop& loop, int fd)
+{
+  char buf[MSG_SIZE];
+  for (;;) {
+    if ((co_await picoevpp::readable(loop, fd) & PICOEV_READ) == 0) {
+      break;
+    }
+    ssize_t r = read(fd, buf, sizeof(buf));
+    if (r > 0) {
+      if (write(fd, buf, r) != r) {
+	abort();
+      }
+    } else if (r == 0 || errno != EAGAIN) {
+      break;
+    }
+  }
+  picoevpp::detach(loop, fd);
+  close(fd);
+}
+
+static void bench_coro(picoevpp::coro_loop& loop, int run_idx)
+{
+  open_conns(loop.get());
+  for (int i = 0; i < num_conns; ++i) {
+    echo_coro(loop, fds[i * 2]);
+  }
+  run(loop, "echo_coro", run_idx);
+  while (picoev_next_fd(loop.get(), -1) != -1) {
+    loop.loop_once(0);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int ch;
+
+  while ((ch = getopt(argc, argv, "n:a:r:")) != -1) {
+    switch (ch) {
+    case 'n':
+      num_conns = atoi(optarg);
+      break;
+    case 'a':
+      num_active = atoi(optarg);
+      break;
+    case 'r':
+      num_runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n num_conns] [-a num_active] [-r runs]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+
+  bench_raise_nofile((rlim_t)num_conns * 2 + 50);
+  picoev_init(num_conns * 2 + 50);
+  {
+    picoevpp::coro_loop loop(60);
+    assert(loop.is_valid());
+    printf("backend,scenario,fds,run,usec,ops,ops_per_sec\n");
+    for (int run_idx = 0; run_idx < num_runs; ++run_idx) {
+      bench_callback(loop, run_idx);
+      bench_coro(loop, run_idx);
+    }
+  }
+  picoev_deinit();
+
+  return 0;
+}
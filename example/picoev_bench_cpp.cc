@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares the ping chain of picoev_bench.c driven through the C API and
+ * through the C++ wrapper (picoev.hpp), printing CSV rows in the format of
+ * picoev_bench.
+ *
+ * usage: picoev_bench_cpp [-n num_pipes] [-a num_active] [-r runs]
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <memory>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#include "picoev.hpp"
+#include "bench_util.h"
+
+static int num_pipes = 1000, num_active = 100, num_runs = 3;
+static int num_events = 1000000;
+static std::vector<int> pipes; /* pipes[i * 2] is read by the loop */
+static int count, writes;
+
+static void on_read(int fd, int widx)
+{
+  unsigned char ch;
+  count += read(fd, &ch, sizeof(ch));
+  if (writes != 0) {
+    if (widx >= num_pipes) {
+      widx -= num_pipes;
+    }
+    if (write(pipes[2 * widx + 1], "e", 1) != 1) {
+      abort();
+    }
+    --writes;
+  }
+}
+
+static void start_chain()
+{
+  for (int i = 0; i < num_active; ++i) {
+    if (write(pipes[i * (num_pipes / num_active) * 2 + 1], "e", 1) != 1) {
+      abort();
+    }
+  }
+  count = 0;
+  writes = num_events - num_active;
+}
+
+/* C API, with per-connection state allocated like the C++ handlers */
+struct chain_conn {
+  int fd;
+  int idx;
+};
+
+static void c_callback(picoev_loop*, int, int, void* cb_arg)
+{
+  chain_conn* conn = (chain_conn*)cb_arg;
+  on_read(conn->fd, conn->idx + 1);
+}
+
+static void bench_c(picoevpp::loop& loop, int run)
+{
+  std::vector<std::unique_ptr<chain_conn> > conns;
+  for (int i = 0; i < num_pipes; ++i) {
+    chain_conn* conn = new chain_conn;
+    conn->fd = pipes[i * 2];
+    conn->idx = i;
+    conns.emplace_back(conn);
+    picoev_add(loop.get(), conn->fd, PICOEV_READ, 0, c_callback, conn);
+  }
+  start_chain();
+  double start = bench_now_usec();
+  while (count != num_events) {
+    loop.loop_once(0);
+  }
+  bench_report(PICOEV_BENCH_BACKEND, "chain_c", num_pipes * 2, run,
+	       bench_now_usec() - start, count);
+  for (int i = 0; i < num_pipes; ++i) {
+    picoev_del(loop.get(), pipes[i * 2]);
+  }
+}
+
+/* C++ wrapper */
+class chain_handler : public picoevpp::handler<chain_handler> {
+  int idx_;
+public:
+  chain_handler(int fd, int idx)
+    : picoevpp::handler<chain_handler>(fd), idx_(idx) {}
+  /* the fds are owned by the pipes vector */
+  ~chain_handler() { release(); }
+  void on_event(int) { on_read(fd(), idx_ + 1); }
+};
+
+static void bench_cpp(picoevpp::loop& loop, int run)
+{
+  std::vector<std::unique_ptr<chain_handler> > handlers;
+  for (int i = 0; i < num_pipes; ++i) {
+    handlers.emplace_back(new chain_handler(pipes[i * 2], i));
+    handlers.back()->add(loop, PICOEV_READ);
+  }
+  start_chain();
+  double start = bench_now_usec();
+  while (count != num_events) {
+    loop.loop_once(0);
+  }
+  bench_report(PICOEV_BENCH_BACKEND, "chain_cpp", num_pipes * 2, run,
+	       bench_now_usec() - start, count);
+}
+
+int main(int argc, char** argv)
+{
+  int ch;
+
+  while ((ch = getopt(argc, argv, "n:a:r:")) != -1) {
+    switch (ch) {
+    case 'n':
+      num_pipes = atoi(optarg);
+      break;
+    case 'a':
+      num_active = atoi(optarg);
+      break;
+    case 'r':
+      num_runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n num_pipes] [-a num_active] [-r runs]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+
+  bench_raise_nofile((rlim_t)num_pipes * 2 + 50);
+  picoev_init(num_pipes * 2 + 50);
+  {
+    picoevpp::loop loop(60);
+    assert(loop.is_valid());
+    pipes.resize(num_pipes * 2);
+    for (int i = 0; i < num_pipes; ++i) {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, &pipes[i * 2]) != 0) {
+	perror("socketpair");
+	exit(1);
+      }
+      fcntl(pipes[i * 2], F_SETFL, O_NONBLOCK);
+    }
+    printf("backend,scenario,fds,run,usec,ops,ops_per_sec\n");
+    for (int run = 0; run < num_runs; ++run) {
+      bench_c(loop, run);
+      bench_cpp(loop, run);
+    }
+  }
+  picoev_deinit();
+
+  return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmark of the dispatch of a batch of events by the epoll backend, built
+ * with the prefetch of the fd table entries disabled ("none"), over the
+ * whole batch ("batch", PICOEV_PREFETCH_DISTANCE=1024) and over the default
+ * window ("window"). -n eventfds are registered (capped by RLIMIT_NOFILE),
+ * each with its own state as cb_arg; in each round -a of them picked at
+ * random are made readable, the caches are optionally flushed by writing -t
+ * KB of memory, and only picoev_loop_once is timed. Cache misses of the
+ * timed part are counted through perf_event_open (-1 if not available).
+ * Prints a CSV row per run.
+ *
+ * usage: picoev_bench_dispatch [-n num_fds] [-a num_active] [-o rounds]
+ *                              [-t thrash_kb] [-r runs]
+ */
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+struct conn {
+  unsigned long long hits;
+  char state[56];
+};
+
+static int num_fds = 100000, num_active = 1024, num_rounds = 2000,
+  thrash_kb = 32768, num_runs = 3;
+static unsigned long long calls;
+
+static void read_callback(picoev_loop* loop __attribute__((unused)),
+			  int fd __attribute__((unused)),
+			  int revents __attribute__((unused)), void* cb_arg)
+{
+  struct conn* conn = cb_arg;
+  ++conn->hits;
+  ++calls;
+}
+
+/* opens a counter of the cache misses of this thread, or returns -1 */
+static int open_miss_counter(void)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main(int argc, char** argv)
+{
+  picoev_loop* loop;
+  struct conn* conns;
+  int* fds, * picked;
+  char* thrash = NULL;
+  rlim_t lim;
+  int ch, i, run, miss_fd;
+
+  while ((ch = getopt(argc, argv, "n:a:o:t:r:")) != -1) {
+    switch (ch) {
+    case 'n':
+      num_fds = atoi(optarg);
+      break;
+    case 'a':
+      num_active = atoi(optarg);
+      break;
+    case 'o':
+      num_rounds = atoi(optarg);
+      break;
+    case 't':
+      thrash_kb = atoi(optarg);
+      break;
+    case 'r':
+      num_runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-n num_fds] [-a num_active] [-o rounds]"
+	      " [-t thrash_kb] [-r runs]\n", argv[0]);
+      exit(1);
+    }
+  }
+  
+  /* use as many fds as allowed, keeping some for the epoll fd, etc. */
+  if ((lim = bench_raise_nofile((rlim_t)num_fds + 100))
+      < (rlim_t)num_fds + 100) {
+    fprintf(stderr, "capping the # of fds to %d (RLIMIT_NOFILE)\n",
+	    (int)lim - 100);
+    num_fds = (int)lim - 100;
+  }
+  if (num_active > num_fds) {
+    num_active = num_fds;
+  }
+  
+  if (picoev_init(num_fds + 100) != 0
+      || (loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to initialize picoev\n");
+    exit(1);
+  }
+  conns = calloc(num_fds, sizeof(*conns));
+  fds = malloc(num_fds * sizeof(*fds));
+  picked = malloc(num_active * sizeof(*picked));
+  if (thrash_kb != 0) {
+    thrash = malloc((size_t)thrash_kb * 1024);
+  }
+  if (conns == NULL || fds == NULL || picked == NULL
+      || (thrash_kb != 0 && thrash == NULL)) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (i = 0; i < num_fds; ++i) {
+    if ((fds[i] = eventfd(0, EFD_NONBLOCK)) == -1) {
+      perror("eventfd");
+      exit(1);
+    }
+    picoev_add(loop, fds[i], PICOEV_READ, 0, read_callback, conns + i);
+  }
+  miss_fd = open_miss_counter();
+  
+  printf("backend,variant,fds,active,run,usec,events,nsec_per_event,"
+	 "cache_misses\n");
+  for (run = 0; run < num_runs; ++run) {
+    unsigned long long rnd = 88172645463325252ULL + run;
+    unsigned long long misses = 0;
+    double usec = 0;
+    int round;
+    calls = 0;
+    if (miss_fd != -1) {
+      ioctl(miss_fd, PERF_EVENT_IOC_RESET, 0);
+    }
+    for (round = 0; round < num_rounds; ++round) {
+      uint64_t one = 1, cnt;
+      double start;
+      for (i = 0; i < num_active; ++i) {
+	rnd ^= rnd << 13;
+	rnd ^= rnd >> 7;
+	rnd ^= rnd << 17;
+	picked[i] = fds[rnd % num_fds];
+	if (write(picked[i], &one, sizeof(one)) != sizeof(one)) {
+	  perror("write");
+	  exit(1);
+	}
+      }
+      if (thrash != NULL) {
+	memset(thrash, round, (size_t)thrash_kb * 1024);
+      }
+      if (miss_fd != -1) {
+	ioctl(miss_fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+      start = bench_now_sec();
+      picoev_loop_once(loop, 0);
+      usec += (bench_now_sec() - start) * 1000000;
+      if (miss_fd != -1) {
+	ioctl(miss_fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+      /* reset the readiness (level-triggered) outside of the timing */
+      for (i = 0; i < num_active; ++i) {
+	if (read(picked[i], &cnt, sizeof(cnt)) == -1 && errno != EAGAIN) {
+	  perror("read");
+	  exit(1);
+	}
+      }
+    }
+    if (miss_fd != -1
+	&& read(miss_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = 0;
+    }
+    printf("%s,%s,%d,%d,%d,%.0f,%llu,%.1f,%lld\n", PICOEV_BENCH_BACKEND,
+	   PICOEV_BENCH_VARIANT, num_fds, num_active, run, usec, calls,
+	   usec * 1000 / calls, miss_fd != -1 ? (long long)misses : -1LL);
+    fflush(stdout);
+  }
+  
+  return 0;
+}
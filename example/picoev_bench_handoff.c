@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Restarts a server under load and counts the requests that fail. Client
+ * processes keep connecting to the server, each connection sending a
+ * request and reading the response. Half a second into the run, the
+ * server is replaced by a new process that takes startup_ms to initialize,
+ * in turn by
+ *
+ *  - restart: stopping the old server (which closes its listening socket
+ *    and drains its connections) and then starting the new one, which
+ *    binds the port afresh
+ *  - handoff: starting the new server first, which once initialized
+ *    receives the listening socket from the old one through
+ *    picoev_handoff_send / picoev_handoff_recv, the old one then draining
+ *    its connections with picoev_drain
+ *
+ * Prints one CSV row per mode; errors are the requests refused or reset,
+ * max_ms the worst latency of a request (failures retried after 10 msec
+ * count as one), and left the connections the old server gave up on.
+ *
+ * usage: picoev_bench_handoff [-c clients] [-s startup_ms] [-d secs]
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+static int num_clients = 4, startup_ms = 200, secs = 2;
+static struct sockaddr_in addr;
+static int results[2] = { -1, -1 }; /* pipe from the clients */
+static volatile sig_atomic_t stopping;
+static int draining;
+
+static void on_sigterm(int signo __attribute__((unused)))
+{
+  stopping = 1;
+}
+
+static int open_listener(void)
+{
+  int fd, flag = 1;
+  
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) != 0
+      || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+      || listen(fd, 128) != 0) {
+    perror("listen");
+    exit(1);
+  }
+  return fd;
+}
+
+/* sends requests one connection at a time until SIGTERM, then writes
+   "requests errors max_usec" to out_fd */
+static void run_client(int out_fd)
+{
+  unsigned long long requests = 0, errors = 0, max_usec = 0, usec;
+  struct sigaction sa;
+  char buf[64];
+  double start = 0;
+  int fd, retrying = 0;
+  ssize_t r;
+  
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_sigterm; /* without SA_RESTART, to interrupt I/O */
+  sigaction(SIGTERM, &sa, NULL);
+  while (! stopping) {
+    if (! retrying) {
+      start = bench_now_sec();
+    }
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+      perror("socket");
+      exit(1);
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+	|| write(fd, "ping\n", 5) != 5
+	|| (r = read(fd, buf, sizeof(buf))) != 3) {
+      close(fd);
+      if (stopping) {
+	break;
+      }
+      ++requests;
+      ++errors;
+      retrying = 1;
+      usleep(10000);
+      continue;
+    }
+    close(fd);
+    ++requests;
+    retrying = 0;
+    if ((usec = (unsigned long long)((bench_now_sec() - start) * 1000000))
+	> max_usec) {
+      max_usec = usec;
+    }
+  }
+  r = snprintf(buf, sizeof(buf), "%llu %llu %llu\n", requests, errors,
+	       max_usec);
+  if (write(out_fd, buf, r) != r) {
+    perror("write");
+  }
+}
+
+static void conn_callback(picoev_loop* loop, int fd, int revents,
+			  void* cb_arg)
+{
+  char buf[64];
+  
+  if ((revents & PICOEV_READ) != 0 && read(fd, buf, sizeof(buf)) > 0) {
+    if (write(fd, "ok\n", 3) != 3) {
+      perror("write");
+    }
+  }
+  picoev_del(loop, fd);
+  close(fd);
+  if (! draining) {
+    picoev_listener_release((picoev_listener*)cb_arg);
+  }
+}
+
+static void accept_callback(picoev_loop* loop, int fd, void* cb_arg)
+{
+  picoev_add(loop, fd, PICOEV_READ, 5, conn_callback, cb_arg);
+}
+
+/* 'h' hands the listening socket over, 'q' closes it */
+static void control_callback(picoev_loop* loop, int fd,
+			     int revents __attribute__((unused)),
+			     void* cb_arg)
+{
+  picoev_listener* listener = (picoev_listener*)cb_arg;
+  int listen_fd = listener->fd;
+  char cmd;
+  
+  if (read(fd, &cmd, 1) != 1) {
+    cmd = 'q';
+  }
+  if (cmd == 'h' && picoev_handoff_send(fd, &listen_fd, 1) != 0) {
+    perror("picoev_handoff_send");
+    exit(1);
+  }
+  picoev_listener_del(listener);
+  close(listen_fd);
+  picoev_del(loop, fd);
+  draining = 1;
+}
+
+/* serves until told by control_fd (if not -1), exits with the number of
+   the connections left by picoev_drain */
+static void run_server(int listen_fd, int control_fd)
+{
+  picoev_loop* loop;
+  picoev_listener* listener;
+  int left;
+  
+  /* for the main process to see the end of the results */
+  close(results[0]);
+  close(results[1]);
+  picoev_init(1024);
+  if ((loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to create a loop\n");
+    exit(1);
+  }
+  if ((listener = picoev_listener_add(loop, listen_fd, accept_callback,
+				      NULL))
+      == NULL) {
+    perror("picoev_listener_add");
+    exit(1);
+  }
+  listener->cb_arg = listener;
+  if (control_fd != -1) {
+    picoev_add(loop, control_fd, PICOEV_READ, 0, control_callback,
+	       listener);
+  }
+  while (! draining) {
+    picoev_loop_once(loop, 1);
+  }
+  left = picoev_drain(loop, 5);
+  picoev_destroy_loop(loop);
+  picoev_deinit();
+  _exit(left);
+}
+
+static pid_t spawn_new_server(const char* mode, int control_fd)
+{
+  pid_t pid;
+  int listen_fd;
+  
+  if ((pid = fork()) != 0) {
+    return pid;
+  }
+  usleep(startup_ms * 1000);
+  if (strcmp(mode, "handoff") == 0) {
+    if (write(control_fd, "h", 1) != 1
+	|| picoev_handoff_recv(control_fd, &listen_fd, 1) != 1) {
+      perror("picoev_handoff_recv");
+      _exit(255);
+    }
+  } else {
+    listen_fd = open_listener();
+  }
+  run_server(listen_fd, -1);
+  return 0;
+}
+
+static void run(const char* mode)
+{
+  unsigned long long requests = 0, errors = 0, max_usec = 0, r, e, m;
+  pid_t* clients = (pid_t*)malloc(sizeof(pid_t) * num_clients), old, new;
+  int listen_fd, control[2], i, status;
+  socklen_t addrlen = sizeof(addr);
+  FILE* fp;
+  
+  /* listen to an ephemeral port of the loopback */
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  listen_fd = open_listener();
+  getsockname(listen_fd, (struct sockaddr*)&addr, &addrlen);
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, control) != 0
+      || pipe(results) != 0) {
+    perror("socketpair");
+    exit(1);
+  }
+  
+  /* the old server holds the only copy of the listening socket */
+  if ((old = fork()) == 0) {
+    close(control[1]);
+    run_server(listen_fd, control[0]);
+  }
+  close(listen_fd);
+  close(control[0]);
+  for (i = 0; i < num_clients; ++i) {
+    if ((clients[i] = fork()) == 0) {
+      run_client(results[1]);
+      _exit(0);
+    }
+  }
+  
+  usleep(500000);
+  if (strcmp(mode, "handoff") == 0) {
+    new = spawn_new_server(mode, control[1]);
+  } else {
+    if (write(control[1], "q", 1) != 1) {
+      perror("write");
+    }
+    waitpid(old, &status, 0);
+    new = spawn_new_server(mode, control[1]);
+  }
+  usleep(secs * 1000000);
+  
+  for (i = 0; i < num_clients; ++i) {
+    kill(clients[i], SIGTERM);
+    waitpid(clients[i], NULL, 0);
+  }
+  close(results[1]);
+  fp = fdopen(results[0], "r");
+  while (fscanf(fp, "%llu %llu %llu", &r, &e, &m) == 3) {
+    requests += r;
+    errors += e;
+    if (m > max_usec) {
+      max_usec = m;
+    }
+  }
+  fclose(fp);
+  if (strcmp(mode, "handoff") == 0) {
+    waitpid(old, &status, 0);
+  }
+  kill(new, SIGKILL);
+  waitpid(new, NULL, 0);
+  close(control[1]);
+  free(clients);
+  
+  printf("%s,%s,%d,%d,%llu,%llu,%.3f,%.1f,%d\n", PICOEV_BENCH_BACKEND, mode,
+	 num_clients, startup_ms, requests, errors,
+	 requests != 0 ? errors * 100.0 / requests : 0.0, max_usec / 1000.0,
+	 WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+  fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+  static const char* modes[] = { "restart", "handoff" };
+  int ch;
+  size_t i;
+  
+  while ((ch = getopt(argc, argv, "c:s:d:")) != -1) {
+    switch (ch) {
+    case 'c':
+      num_clients = atoi(optarg);
+      break;
+    case 's':
+      startup_ms = atoi(optarg);
+      break;
+    case 'd':
+      secs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c clients] [-s startup_ms] [-d secs]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+  
+  signal(SIGPIPE, SIG_IGN);
+  printf("backend,mode,clients,startup_ms,requests,errors,error_pct,max_ms,"
+	 "left\n");
+  for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+    run(modes[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmarks of the fd table, comparing its layouts (build with
+ * PICOEV_SPLIT_FDS=0 and 1). Like picoev_bench_alloc, the fds are registered
+ * to a select loop without being opened. In the "dispatch" scenario each op
+ * picks an fd at random and dispatches an event to it the way the backends
+ * do; "dispatch_refresh" also refreshes its timeout, as servers usually do
+ * on each event. "iterate" enumerates -l fds spread over the table using
+ * picoev_next_fd, as done on graceful shutdown, ops being the fds visited.
+ * Prints CSV rows in the format of picoev_bench.
+ *
+ * usage: picoev_bench_layout [-o num_ops] [-l num_live] [-r runs]
+ *                            [num_fds ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+#if PICOEV_SPLIT_FDS
+# define BACKEND_NAME "select+split"
+#else
+# define BACKEND_NAME "select"
+#endif
+
+static int num_ops = 10000000, num_live = 5000, num_runs = 3;
+static unsigned long long calls;
+
+static void count_callback(picoev_loop* loop __attribute__((unused)),
+			   int fd __attribute__((unused)),
+			   int revents __attribute__((unused)),
+			   void* cb_arg __attribute__((unused)))
+{
+  ++calls;
+}
+
+static void bench_iterate(int num_fds, int run)
+{
+  picoev_loop* loop;
+  unsigned long long visited = 0;
+  int step = num_fds / num_live > 0 ? num_fds / num_live : 1, rounds = 0;
+  double start, usec;
+  int fd;
+  
+  if (picoev_init(num_fds) != 0
+      || (loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to initialize picoev\n");
+    exit(1);
+  }
+  for (fd = step / 2; fd < num_fds; fd += step) {
+    picoev_add(loop, fd, PICOEV_READ, 0, count_callback, NULL);
+  }
+  start = bench_now_usec();
+  do {
+    for (fd = picoev_next_fd(loop, -1); fd != -1;
+	 fd = picoev_next_fd(loop, fd)) {
+      ++visited;
+    }
+    ++rounds;
+  } while ((usec = bench_now_usec() - start) < 100000 || rounds < 3);
+  bench_report(BACKEND_NAME, "iterate", num_fds, run, usec, visited);
+  
+  picoev_destroy_loop(loop);
+  picoev_deinit();
+}
+
+static void bench(int num_fds, int refresh, int run)
+{
+  picoev_loop* loop;
+  unsigned long long rnd = 88172645463325252ULL;
+  double start, usec;
+  int i;
+  
+  if (picoev_init(num_fds) != 0
+      || (loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to initialize picoev\n");
+    exit(1);
+  }
+  for (i = 0; i < num_fds; ++i) {
+    picoev_add(loop, i, PICOEV_READ, 1 + i % 60, count_callback, NULL);
+  }
+  calls = 0;
+  start = bench_now_usec();
+  for (i = 0; i < num_ops; ++i) {
+    int fd;
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    fd = (int)(rnd % num_fds);
+    if (picoev_is_active(loop, fd)) {
+      picoev_call_internal(loop, fd, picoev.fds + fd, PICOEV_READ);
+      if (refresh) {
+	picoev_refresh_timeout(loop, fd, 30);
+      }
+    }
+  }
+  usec = bench_now_usec() - start;
+  if (calls != (unsigned long long)num_ops) {
+    abort();
+  }
+  bench_report(BACKEND_NAME, refresh ? "dispatch_refresh" : "dispatch",
+	       num_fds, run, usec, num_ops);
+  
+  picoev_destroy_loop(loop);
+  picoev_deinit();
+}
+
+int main(int argc, char** argv)
+{
+  static const int default_fds[] = { 10000, 100000, 1000000 };
+  int ch, run, i, n;
+
+  while ((ch = getopt(argc, argv, "o:l:r:")) != -1) {
+    switch (ch) {
+    case 'o':
+      num_ops = atoi(optarg);
+      break;
+    case 'l':
+      num_live = atoi(optarg);
+      break;
+    case 'r':
+      num_runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-o num_ops] [-l num_live] [-r runs]"
+	      " [num_fds ...]\n", argv[0]);
+      exit(1);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  printf("backend,scenario,fds,run,usec,ops,ops_per_sec\n");
+  n = argc != 0 ? argc : (int)(sizeof(default_fds) / sizeof(default_fds[0]));
+  for (i = 0; i < n; ++i) {
+    int num_fds = argc != 0 ? atoi(argv[i]) : default_fds[i];
+    for (run = 0; run < num_runs; ++run) {
+      bench(num_fds, 0, run);
+      bench(num_fds, 1, run);
+      bench_iterate(num_fds, run);
+    }
+  }
+  return 0;
+}
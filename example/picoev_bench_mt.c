@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Multi-loop scaling benchmark. For each number of loops from 1 to
+ * max_loops, runs that many loops on as many threads, each driving its own
+ * ring of socketpairs with num_active tokens circulating and refreshing a
+ * timeout on every read. Prints one CSV row per loop and an aggregate row
+ * (loop column "all") per configuration:
+ *
+ *   backend,loops,loop,usec,events,events_per_sec,efficiency
+ *
+ * where efficiency is the rate divided by that of the single loop run
+ * (times the number of loops for the aggregate row).
+ *
+ * usage: picoev_bench_mt [-l max_loops] [-n pipes_per_loop] [-a num_active]
+ *                        [-d duration_msec]
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+typedef struct bench_loop_st bench_loop;
+
+typedef struct bench_pipe_st {
+  bench_loop* owner;
+  int fds[2]; /* fds[0] is read by the loop */
+  int next_wfd; /* write end of the next pipe in the ring */
+} bench_pipe;
+
+struct bench_loop_st {
+  pthread_t tid;
+  picoev_loop* loop;
+  bench_pipe* pipes;
+  unsigned long long events;
+  double usec;
+};
+
+static int max_loops = 4, num_pipes = 100, num_active = 4, duration = 1000;
+/* picoev_create_loop and picoev_destroy_loop are not thread-safe */
+static pthread_mutex_t loops_lock = PTHREAD_MUTEX_INITIALIZER;
+static int num_ready, running; /* accessed atomically */
+
+/* forwards the token to the next pipe of the ring */
+static void read_callback(picoev_loop* loop, int fd, int revents,
+			  void* cb_arg)
+{
+  bench_pipe* p = (bench_pipe*)cb_arg;
+  unsigned char ch;
+
+  if ((revents & PICOEV_READ) == 0) {
+    return;
+  }
+  picoev_refresh_timeout(loop, fd, 10);
+  if (read(fd, &ch, 1) == 1) {
+    ++p->owner->events;
+    if (write(p->next_wfd, &ch, 1) != 1) {
+      abort();
+    }
+  }
+}
+
+/* sets up the loop and its ring on the thread that runs it, so that their
+   memory is first touched there */
+static void* loop_main(void* _l)
+{
+  bench_loop* l = (bench_loop*)_l;
+  double start;
+  int i;
+
+  pthread_mutex_lock(&loops_lock);
+  l->loop = picoev_create_loop(60);
+  pthread_mutex_unlock(&loops_lock);
+  l->pipes = (bench_pipe*)calloc(num_pipes, sizeof(bench_pipe));
+  assert(l->loop != NULL && l->pipes != NULL);
+  for (i = 0; i < num_pipes; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, l->pipes[i].fds) != 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    fcntl(l->pipes[i].fds[0], F_SETFL, O_NONBLOCK);
+    l->pipes[i].owner = l;
+  }
+  for (i = 0; i < num_pipes; ++i) {
+    l->pipes[i].next_wfd = l->pipes[(i + 1) % num_pipes].fds[1];
+    picoev_add(l->loop, l->pipes[i].fds[0], PICOEV_READ, 10, read_callback,
+	       l->pipes + i);
+  }
+  for (i = 0; i < num_active; ++i) {
+    if (write(l->pipes[i * num_pipes / num_active].fds[1], "e", 1) != 1) {
+      abort();
+    }
+  }
+
+  __atomic_add_fetch(&num_ready, 1, __ATOMIC_RELEASE);
+  while (! __atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+  }
+  start = bench_now_usec();
+  while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+    picoev_loop_once(l->loop, 0);
+  }
+  l->usec = bench_now_usec() - start;
+
+  for (i = 0; i < num_pipes; ++i) {
+    picoev_del(l->loop, l->pipes[i].fds[0]);
+    close(l->pipes[i].fds[0]);
+    close(l->pipes[i].fds[1]);
+  }
+  free(l->pipes);
+  pthread_mutex_lock(&loops_lock);
+  picoev_destroy_loop(l->loop);
+  pthread_mutex_unlock(&loops_lock);
+  return NULL;
+}
+
+static double run(int num_loops, double single_rate)
+{
+  bench_loop* loops;
+  unsigned long long total_events = 0;
+  double total_rate = 0, usec = 0;
+  int i;
+
+  loops = (bench_loop*)calloc(num_loops, sizeof(bench_loop));
+  assert(loops != NULL);
+
+  /* start the loops at once after all of them are set up */
+  __atomic_store_n(&num_ready, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+  for (i = 0; i < num_loops; ++i) {
+    pthread_create(&loops[i].tid, NULL, loop_main, loops + i);
+  }
+  while (__atomic_load_n(&num_ready, __ATOMIC_ACQUIRE) != num_loops) {
+    usleep(1000);
+  }
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  usleep(duration * 1000);
+  __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+
+  for (i = 0; i < num_loops; ++i) {
+    bench_loop* l = loops + i;
+    double rate;
+    pthread_join(l->tid, NULL);
+    rate = l->events * 1000000.0 / l->usec;
+    printf("%s,%d,%d,%.0f,%llu,%.0f,%.3f\n", PICOEV_BENCH_BACKEND, num_loops,
+	   i, l->usec, l->events, rate,
+	   single_rate != 0 ? rate / single_rate : 1);
+    total_events += l->events;
+    total_rate += rate;
+    if (usec < l->usec) {
+      usec = l->usec;
+    }
+  }
+  printf("%s,%d,all,%.0f,%llu,%.0f,%.3f\n", PICOEV_BENCH_BACKEND, num_loops,
+	 usec, total_events, total_rate,
+	 single_rate != 0 ? total_rate / (single_rate * num_loops) : 1);
+  fflush(stdout);
+  free(loops);
+
+  return total_rate;
+}
+
+int main(int argc, char** argv)
+{
+  double single_rate = 0;
+  int num_loops, ch;
+
+  while ((ch = getopt(argc, argv, "l:n:a:d:")) != -1) {
+    switch (ch) {
+    case 'l':
+      max_loops = atoi(optarg);
+      break;
+    case 'n':
+      num_pipes = atoi(optarg);
+      break;
+    case 'a':
+      num_active = atoi(optarg);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-l max_loops] [-n pipes_per_loop]"
+	      " [-a num_active] [-d duration_msec]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (max_loops < 1 || num_pipes < 1 || num_active < 1
+      || num_active > num_pipes) {
+    fprintf(stderr, "invalid arguments\n");
+    exit(1);
+  }
+
+  bench_raise_nofile((rlim_t)max_loops * num_pipes * 2 + 50);
+
+  picoev_init(max_loops * (num_pipes * 2 + 10) + 50);
+  printf("backend,loops,loop,usec,events,events_per_sec,efficiency\n");
+  for (num_loops = 1; num_loops <= max_loops; ++num_loops) {
+    double rate = run(num_loops, single_rate);
+    if (num_loops == 1) {
+      single_rate = rate;
+    }
+  }
+  picoev_deinit();
+
+  return 0;
+}
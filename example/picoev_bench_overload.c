@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runs a server under fd exhaustion: a child process keeps trying to hold
+ * more connections than the RLIMIT_NOFILE of the server allows, reconnecting
+ * whenever one is closed. The server holds every connection it accepts, so
+ * it stays out of fds, and is run in turn
+ *
+ *  - naive: accept(2) called from a plain picoev_add handler, which spins
+ *    once out of fds since the listener stays readable
+ *  - reserve: picoev_listener_add, which drops a connection with the
+ *    reserved fd and backs off
+ *  - limit: the same with picoev_listener_set_limit, stopping at max_conns
+ *    and resuming at 3/4 of it
+ *
+ * Prints one CSV row per mode; cpu_pct is the CPU time of the server over
+ * the wall clock time, and should stay flat (near zero) except for naive.
+ *
+ * usage: picoev_bench_overload [-c client_conns] [-f fd_limit] [-m max_conns]
+ *                              [-d secs]
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+static int client_conns = 256, fd_limit = 64, max_conns = 32, secs = 3;
+static picoev_listener* listener;
+static int listen_fd;
+
+/* keeps client_conns connections to the server, until killed */
+static void run_client(struct sockaddr_in* addr)
+{
+  int* fds = (int*)malloc(sizeof(int) * client_conns), i;
+  struct pollfd* pfds
+    = (struct pollfd*)malloc(sizeof(struct pollfd) * client_conns);
+  char buf[256];
+  
+  for (i = 0; i < client_conns; ++i) {
+    fds[i] = -1;
+  }
+  for (;;) {
+    for (i = 0; i < client_conns; ++i) {
+      if (fds[i] == -1 && (fds[i] = socket(AF_INET, SOCK_STREAM, 0)) != -1) {
+	fcntl(fds[i], F_SETFL, O_NONBLOCK);
+	connect(fds[i], (struct sockaddr*)addr, sizeof(*addr));
+      }
+      pfds[i].fd = fds[i];
+      pfds[i].events = POLLIN;
+    }
+    /* the server never writes, so readable means closed */
+    if (poll(pfds, client_conns, 20) > 0) {
+      for (i = 0; i < client_conns; ++i) {
+	if (pfds[i].revents != 0 && read(fds[i], buf, sizeof(buf)) <= 0) {
+	  close(fds[i]);
+	  fds[i] = -1;
+	}
+      }
+    }
+  }
+}
+
+static void conn_callback(picoev_loop* loop, int fd, int revents,
+			  void* cb_arg __attribute__((unused)))
+{
+  char buf[256];
+  
+  if ((revents & PICOEV_READ) != 0 && read(fd, buf, sizeof(buf)) <= 0) {
+    picoev_del(loop, fd);
+    close(fd);
+    if (listener != NULL) {
+      picoev_listener_release(listener);
+    }
+  }
+}
+
+static unsigned long long naive_accepted;
+
+static void naive_accept_callback(picoev_loop* loop, int fd,
+				  int revents __attribute__((unused)),
+				  void* cb_arg __attribute__((unused)))
+{
+  int newfd;
+  
+  while ((newfd = accept(fd, NULL, NULL)) != -1) {
+    fcntl(newfd, F_SETFL, O_NONBLOCK);
+    if (newfd >= picoev.max_fd) {
+      close(newfd);
+      continue;
+    }
+    ++naive_accepted;
+    picoev_add(loop, newfd, PICOEV_READ, 0, conn_callback, NULL);
+  }
+}
+
+static void accept_callback(picoev_loop* loop, int fd,
+			    void* cb_arg __attribute__((unused)))
+{
+  picoev_add(loop, fd, PICOEV_READ, 0, conn_callback, NULL);
+}
+
+static void run_server(const char* mode)
+{
+  picoev_loop* loop;
+  picoev_stats stats;
+  double start, cpu_start, wall, cpu;
+  int fd;
+  
+  if ((loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to create a loop\n");
+    exit(1);
+  }
+  naive_accepted = 0;
+  listener = NULL;
+  if (strcmp(mode, "naive") == 0) {
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    picoev_add(loop, listen_fd, PICOEV_READ, 0, naive_accept_callback, NULL);
+  } else {
+    if ((listener = picoev_listener_add(loop, listen_fd, accept_callback,
+					NULL))
+	== NULL) {
+      perror("picoev_listener_add");
+      exit(1);
+    }
+    if (strcmp(mode, "limit") == 0) {
+      picoev_listener_set_limit(listener, max_conns, max_conns * 3 / 4);
+    }
+  }
+  
+  start = bench_now_sec();
+  cpu_start = bench_cpu_sec();
+  while (bench_now_sec() - start < secs) {
+    picoev_loop_once(loop, 1);
+  }
+  wall = bench_now_sec() - start;
+  cpu = bench_cpu_sec() - cpu_start;
+  picoev_loop_stats(loop, &stats);
+  printf("%s,%s,%d,%.1f,%.1f,%llu,%llu,%llu\n", PICOEV_BENCH_BACKEND, mode,
+	 fd_limit, wall, cpu * 100 / wall, stats.iterations,
+	 listener != NULL ? listener->num_accepted : naive_accepted,
+	 listener != NULL ? listener->num_dropped : 0ULL);
+  fflush(stdout);
+  
+  /* close the connections, for the next mode to start afresh */
+  if (listener != NULL) {
+    picoev_listener_del(listener);
+    listener = NULL;
+  } else {
+    picoev_del(loop, listen_fd);
+  }
+  while ((fd = picoev_next_fd(loop, -1)) != -1) {
+    picoev_del(loop, fd);
+    close(fd);
+  }
+  picoev_destroy_loop(loop);
+}
+
+int main(int argc, char** argv)
+{
+  static const char* modes[] = { "naive", "reserve", "limit" };
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  struct rlimit rl;
+  pid_t client;
+  int ch, flag = 1;
+  size_t i;
+  
+  while ((ch = getopt(argc, argv, "c:f:m:d:")) != -1) {
+    switch (ch) {
+    case 'c':
+      client_conns = atoi(optarg);
+      break;
+    case 'f':
+      fd_limit = atoi(optarg);
+      break;
+    case 'm':
+      max_conns = atoi(optarg);
+      break;
+    case 'd':
+      secs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c client_conns] [-f fd_limit] "
+	      "[-m max_conns] [-d secs]\n", argv[0]);
+      exit(1);
+    }
+  }
+  
+  /* listen to an ephemeral port of the loopback */
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1
+      || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag))
+      != 0
+      || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+      || listen(listen_fd, 128) != 0
+      || getsockname(listen_fd, (struct sockaddr*)&addr, &addrlen) != 0) {
+    perror("listen");
+    exit(1);
+  }
+  
+  if ((client = fork()) == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (client == 0) {
+    close(listen_fd);
+    rl.rlim_cur = rl.rlim_max = client_conns + 16;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    run_client(&addr);
+    _exit(0);
+  }
+  
+  /* the server runs out of fds at fd_limit */
+  bench_set_nofile(fd_limit, 0);
+  picoev_init(fd_limit);
+  printf("backend,mode,fd_limit,secs,cpu_pct,iterations,accepted,dropped\n");
+  for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+    run_server(modes[i]);
+  }
+  picoev_deinit();
+  
+  kill(client, SIGTERM);
+  waitpid(client, NULL, 0);
+  return 0;
+}
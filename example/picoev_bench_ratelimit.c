@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Throttles conns connections to rate bytes per sec each, the peers keeping
+ * them readable all the time (every byte read is written back by the peer),
+ * in turn
+ *
+ *  - manual: a token bucket kept by the handler, which drops the read
+ *    interest and arms a timeout by hand once it is empty, restoring the
+ *    interest on PICOEV_TIMEOUT
+ *  - wheel: picoev_set_rate_limit and picoev_rate_consume, doing the same
+ *    inside picoev
+ *
+ * Prints one CSV row per mode; cpu_pct is the CPU time over the wall clock
+ * time, and bytes_per_sec the throughput of a connection, which should stay
+ * at about rate for both.
+ *
+ * The default of 400 conns keeps the fds below FD_SETSIZE for select.
+ *
+ * usage: picoev_bench_ratelimit [-c conns] [-r rate] [-d secs]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+typedef struct {
+  int peer_fd;
+  long long tokens; /* of manual */
+  time_t refilled_at;
+} conn_t;
+
+static int num_conns = 400, rate = 4096, secs = 5;
+static conn_t* conns;
+static unsigned long long bytes_read;
+
+/* reads and has the peer write the same amount back, returns the bytes */
+static ssize_t transfer(int fd, conn_t* conn, size_t max)
+{
+  char buf[4096];
+  ssize_t r;
+  
+  if (max > sizeof(buf)) {
+    max = sizeof(buf);
+  }
+  if ((r = read(fd, buf, max)) > 0) {
+    bytes_read += r;
+    if (write(conn->peer_fd, buf, r) != r) {
+      perror("write");
+      exit(1);
+    }
+  }
+  return r;
+}
+
+/* same refill as the built-in one, at the granularity of loop->now */
+static void refill(picoev_loop* loop, conn_t* conn)
+{
+  if (loop->now > conn->refilled_at) {
+    conn->tokens += (long long)rate * (loop->now - conn->refilled_at);
+    if (conn->tokens > rate * 2) {
+      conn->tokens = rate * 2;
+    }
+    conn->refilled_at = loop->now;
+  }
+}
+
+static void manual_callback(picoev_loop* loop, int fd, int revents,
+			    void* cb_arg)
+{
+  conn_t* conn = (conn_t*)cb_arg;
+  ssize_t r;
+  
+  refill(loop, conn);
+  if ((revents & PICOEV_TIMEOUT) != 0) {
+    picoev_set_events(loop, fd, PICOEV_READ);
+    return;
+  }
+  if ((r = transfer(fd, conn, conn->tokens)) > 0) {
+    conn->tokens -= r;
+  }
+  if (conn->tokens <= 0) {
+    /* stop reading until the bucket refills */
+    picoev_set_events(loop, fd, 0);
+    picoev_set_timeout(loop, fd, 1);
+  }
+}
+
+static void wheel_callback(picoev_loop* loop, int fd, int revents,
+			   void* cb_arg)
+{
+  ssize_t r;
+  
+  if ((revents & PICOEV_READ) != 0
+      && (r = transfer(fd, (conn_t*)cb_arg, 4096)) > 0) {
+    picoev_rate_consume(loop, fd, PICOEV_READ, r);
+  }
+}
+
+static void run(const char* mode)
+{
+  picoev_loop* loop;
+  picoev_stats stats;
+  double start, cpu_start, wall, cpu;
+  int i, fd, sv[2];
+  char buf[4096];
+  
+  if ((loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to create a loop\n");
+    exit(1);
+  }
+  loop->now = time(NULL);
+  memset(buf, 'x', sizeof(buf));
+  bytes_read = 0;
+  for (i = 0; i < num_conns; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    conns[i].peer_fd = sv[1];
+    conns[i].tokens = rate * 2;
+    conns[i].refilled_at = loop->now;
+    /* keeps it readable from the start */
+    if (write(sv[1], buf, sizeof(buf)) != sizeof(buf)) {
+      perror("write");
+      exit(1);
+    }
+    if (strcmp(mode, "manual") == 0) {
+      picoev_add(loop, sv[0], PICOEV_READ, 0, manual_callback, conns + i);
+    } else {
+      picoev_add(loop, sv[0], PICOEV_READ, 0, wheel_callback, conns + i);
+      picoev_set_rate_limit(loop, sv[0], PICOEV_READ, rate, rate * 2,
+			    PICOEV_RATE_BYTES);
+    }
+  }
+  
+  start = bench_now_sec();
+  cpu_start = bench_cpu_sec();
+  while (bench_now_sec() - start < secs) {
+    picoev_loop_once(loop, 1);
+  }
+  wall = bench_now_sec() - start;
+  cpu = bench_cpu_sec() - cpu_start;
+  picoev_loop_stats(loop, &stats);
+  printf("%s,%s,%d,%d,%.1f,%.1f,%llu,%llu,%.0f\n", PICOEV_BENCH_BACKEND,
+	 mode, num_conns, rate, wall, cpu * 100 / wall, stats.iterations,
+	 stats.events, bytes_read / wall / num_conns);
+  fflush(stdout);
+  
+  while ((fd = picoev_next_fd(loop, -1)) != -1) {
+    picoev_del(loop, fd);
+    close(fd);
+  }
+  for (i = 0; i < num_conns; ++i) {
+    close(conns[i].peer_fd);
+  }
+  picoev_destroy_loop(loop);
+}
+
+int main(int argc, char** argv)
+{
+  static const char* modes[] = { "manual", "wheel" };
+  int ch;
+  size_t i;
+  
+  while ((ch = getopt(argc, argv, "c:r:d:")) != -1) {
+    switch (ch) {
+    case 'c':
+      num_conns = atoi(optarg);
+      break;
+    case 'r':
+      rate = atoi(optarg);
+      break;
+    case 'd':
+      secs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c conns] [-r rate] [-d secs]\n", argv[0]);
+      exit(1);
+    }
+  }
+  
+  /* both ends of the socket pairs */
+  bench_set_nofile((rlim_t)num_conns * 2 + 16, 1);
+  if ((conns = (conn_t*)malloc(sizeof(conn_t) * num_conns)) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  picoev_init(num_conns * 2 + 16);
+  printf("backend,mode,conns,rate,secs,cpu_pct,iterations,events,"
+	 "bytes_per_sec\n");
+  for (i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+    run(modes[i]);
+  }
+  picoev_deinit();
+  free(conns);
+  return 0;
+}
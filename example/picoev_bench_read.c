@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the throughput of picoev_read_start against the usual handler
+ * calling read(2) itself into a buffer of the same size. Each round writes
+ * a chunk to every socketpair, then runs the loop until all of it has been
+ * consumed; only the loop is timed.
+ *
+ * Prints one CSV row per run.
+ *
+ * usage: picoev_bench_read [-c conns] [-s chunk_size] [-n rounds] [-r runs]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+static int num_conns = 100, chunk_size = 4096, num_rounds = 2000,
+  num_runs = 3;
+static unsigned long long bytes_read, num_events;
+
+static void consume(const char* buf, ssize_t len)
+{
+  /* touch the data, as a parser would */
+  volatile char c = buf[0] ^ buf[len - 1];
+  (void)c;
+  bytes_read += len;
+  ++num_events;
+}
+
+static void read_callback(picoev_loop* loop, int fd, int revents,
+			  void* cb_arg __attribute__((unused)))
+{
+  char buf[PICOEV_READ_BUF_SIZE];
+  ssize_t r;
+  
+  if ((revents & PICOEV_READ) == 0) {
+    return;
+  }
+  r = read(fd, buf, sizeof(buf));
+  if (r > 0) {
+    consume(buf, r);
+  } else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    picoev_del(loop, fd);
+  }
+}
+
+static void data_callback(picoev_loop* loop, int fd, char* buf, ssize_t len,
+			  void* cb_arg __attribute__((unused)))
+{
+  if (len > 0) {
+    consume(buf, len);
+  } else {
+    picoev_del(loop, fd);
+  }
+}
+
+static void bench(const char* mode, int run)
+{
+  picoev_loop* loop;
+  int (*sv)[2], i, j;
+  char* chunk;
+  double sec = 0, start, usec;
+  
+  if ((sv = (int(*)[2])malloc(sizeof(*sv) * num_conns)) == NULL
+      || (chunk = (char*)malloc(chunk_size)) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(chunk, 'x', chunk_size);
+  if ((loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to create a loop\n");
+    exit(1);
+  }
+  for (i = 0; i < num_conns; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) != 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    fcntl(sv[i][0], F_SETFL, O_NONBLOCK);
+    if (strcmp(mode, "completion") == 0) {
+      picoev_read_start(loop, sv[i][0], 0, data_callback, NULL);
+    } else {
+      picoev_add(loop, sv[i][0], PICOEV_READ, 0, read_callback, NULL);
+    }
+  }
+  
+  bytes_read = 0;
+  num_events = 0;
+  for (i = 0; i < num_rounds; ++i) {
+    for (j = 0; j < num_conns; ++j) {
+      if (write(sv[j][1], chunk, chunk_size) != chunk_size) {
+	perror("write");
+	exit(1);
+      }
+    }
+    start = bench_now_sec();
+    while (bytes_read < (unsigned long long)chunk_size * num_conns * (i + 1)) {
+      picoev_loop_once(loop, 0);
+    }
+    sec += bench_now_sec() - start;
+  }
+  usec = sec * 1000000;
+  printf("%s,%s,%d,%d,%d,%llu,%.0f,%.1f,%.0f\n", PICOEV_BENCH_BACKEND, mode,
+	 num_conns, chunk_size, run, num_events, usec,
+	 usec * 1000.0 / num_events, bytes_read / usec);
+  fflush(stdout);
+  
+  for (i = 0; i < num_conns; ++i) {
+    picoev_del(loop, sv[i][0]);
+    close(sv[i][0]);
+    close(sv[i][1]);
+  }
+  picoev_destroy_loop(loop);
+  free(chunk);
+  free(sv);
+}
+
+int main(int argc, char** argv)
+{
+  int ch, run;
+  
+  while ((ch = getopt(argc, argv, "c:s:n:r:")) != -1) {
+    switch (ch) {
+    case 'c':
+      num_conns = atoi(optarg);
+      break;
+    case 's':
+      chunk_size = atoi(optarg);
+      break;
+    case 'n':
+      num_rounds = atoi(optarg);
+      break;
+    case 'r':
+      num_runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr,
+	      "usage: %s [-c conns] [-s chunk_size] [-n rounds] [-r runs]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+  
+  picoev_init(num_conns * 2 + 16);
+  printf("backend,mode,conns,chunk_size,run,events,usec,ns_per_event,"
+	 "mb_per_sec\n");
+  for (run = 0; run < num_runs; ++run) {
+    bench("callback", run);
+    bench("completion", run);
+  }
+  picoev_deinit();
+  return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares picoev_scratch_alloc with malloc/free for the short-lived
+ * buffers of a parsing workload. Each connection is a socketpair left
+ * readable, so that its handler is called on every iteration; the handler
+ * copies a canned HTTP request into a buffer (as if read), splits it into a
+ * header array, lower-cases each header name into a string of its own, and
+ * builds a response with an iovec array. "stack" does the same on fixed
+ * arrays, as the baseline of the dispatch and the parsing.
+ *
+ * Prints one CSV row per run.
+ *
+ * usage: picoev_bench_scratch [-c conns] [-i iterations] [-r runs]
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "picoev.h"
+#include "bench_util.h"
+
+#define READ_BUF_SIZE 4096
+#define MAX_HEADERS 32
+#define RESP_BUF_SIZE 1024
+
+typedef struct {
+  const char* name;
+  size_t name_len;
+  const char* value;
+  size_t value_len;
+} header;
+
+static const char request[] =
+  "GET /index.html?q=picoev HTTP/1.1\r\n"
+  "Host: www.example.com\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Connection: keep-alive\r\n"
+  "Cookie: session=0123456789abcdef; theme=dark\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "\r\n";
+
+static int num_conns = 256, num_iterations = 20000, num_runs = 3;
+static int mode; /* 0: stack, 1: malloc, 2: scratch */
+static unsigned long num_requests;
+volatile unsigned long sink; /* keeps the work from being optimized out */
+
+static void* alloc(picoev_loop* loop, size_t sz)
+{
+  return mode == 2 ? picoev_scratch_alloc(loop, sz) : malloc(sz);
+}
+
+static void release(void* p)
+{
+  if (mode == 1) {
+    free(p);
+  }
+}
+
+/* parses the header lines into hdrs, returns the number of them */
+static int parse(char* buf, size_t len, header* hdrs)
+{
+  char* p = (char*)memchr(buf, '\n', len) + 1, * end = buf + len;
+  int n = 0;
+  
+  while (p < end && *p != '\r' && n < MAX_HEADERS) {
+    char* eol = (char*)memchr(p, '\r', end - p);
+    char* colon = (char*)memchr(p, ':', eol - p);
+    hdrs[n].name = p;
+    hdrs[n].name_len = colon - p;
+    for (colon += 1; *colon == ' '; ++colon)
+      ;
+    hdrs[n].value = colon;
+    hdrs[n].value_len = eol - colon;
+    ++n;
+    p = eol + 2;
+  }
+  return n;
+}
+
+static void callback(picoev_loop* loop, int fd __attribute__((unused)),
+		     int revents __attribute__((unused)),
+		     void* cb_arg __attribute__((unused)))
+{
+  char stack_buf[READ_BUF_SIZE], stack_resp[RESP_BUF_SIZE];
+  char stack_names[MAX_HEADERS][64];
+  header stack_hdrs[MAX_HEADERS];
+  struct iovec stack_iov[4];
+  char* buf, * resp, * names[MAX_HEADERS];
+  header* hdrs;
+  struct iovec* iov;
+  int num_hdrs, i, resp_len;
+  size_t j;
+  
+  /* read */
+  buf = mode == 0 ? stack_buf : (char*)alloc(loop, READ_BUF_SIZE);
+  memcpy(buf, request, sizeof(request) - 1);
+  /* parse, and normalize the names */
+  hdrs = mode == 0 ? stack_hdrs
+    : (header*)alloc(loop, sizeof(header) * MAX_HEADERS);
+  num_hdrs = parse(buf, sizeof(request) - 1, hdrs);
+  for (i = 0; i < num_hdrs; ++i) {
+    names[i] = mode == 0 ? stack_names[i]
+      : (char*)alloc(loop, hdrs[i].name_len + 1);
+    for (j = 0; j < hdrs[i].name_len; ++j) {
+      names[i][j] = tolower((unsigned char)hdrs[i].name[j]);
+    }
+    names[i][j] = '\0';
+  }
+  /* build the response */
+  resp = mode == 0 ? stack_resp : (char*)alloc(loop, RESP_BUF_SIZE);
+  resp_len = snprintf(resp, RESP_BUF_SIZE,
+		      "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n%s: %.*s\r\n"
+		      "\r\n", names[0], (int)hdrs[0].value_len,
+		      hdrs[0].value);
+  iov = mode == 0 ? stack_iov
+    : (struct iovec*)alloc(loop, sizeof(struct iovec) * 4);
+  iov[0].iov_base = resp;
+  iov[0].iov_len = resp_len;
+  iov[1].iov_base = "hello";
+  iov[1].iov_len = 5;
+  sink += iov[0].iov_len + iov[1].iov_len + names[num_hdrs - 1][0];
+  ++num_requests;
+  
+  /* the scratch arena needs no release */
+  release(iov);
+  release(resp);
+  for (i = 0; i < num_hdrs; ++i) {
+    release(names[i]);
+  }
+  release(hdrs);
+  release(buf);
+}
+
+static void bench(const char* name, int run)
+{
+  picoev_loop* loop;
+  int (*sv)[2], i;
+  double start, usec;
+  
+  if ((sv = (int(*)[2])malloc(sizeof(*sv) * num_conns)) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  if ((loop = picoev_create_loop(60)) == NULL) {
+    fprintf(stderr, "failed to create a loop\n");
+    exit(1);
+  }
+  for (i = 0; i < num_conns; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) != 0
+	|| write(sv[i][1], "x", 1) != 1) {
+      perror("socketpair");
+      exit(1);
+    }
+    picoev_add(loop, sv[i][0], PICOEV_READ, 0, callback, NULL);
+  }
+  /* warm up, so that the arena and the malloc pools are populated */
+  picoev_loop_once(loop, 0);
+  
+  num_requests = 0;
+  start = bench_now_usec();
+  for (i = 0; i < num_iterations; ++i) {
+    picoev_loop_once(loop, 0);
+  }
+  usec = bench_now_usec() - start;
+  printf("%s,%d,%d,%d,%lu,%.0f,%.1f\n", name, num_conns, run,
+	 num_iterations, num_requests, usec, usec * 1000.0 / num_requests);
+  fflush(stdout);
+  
+  for (i = 0; i < num_conns; ++i) {
+    picoev_del(loop, sv[i][0]);
+    close(sv[i][0]);
+    close(sv[i][1]);
+  }
+  picoev_destroy_loop(loop);
+  free(sv);
+}
+
+int main(int argc, char** argv)
+{
+  static const char* names[] = { "stack", "malloc", "scratch" };
+  int ch, run;
+  
+  while ((ch = getopt(argc, argv, "c:i:r:")) != -1) {
+    switch (ch) {
+    case 'c':
+      num_conns = atoi(optarg);
+      break;
+    case 'i':
+      num_iterations = atoi(optarg);
+      break;
+    case 'r':
+      num_runs = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-c conns] [-i iterations] [-r runs]\n",
+	      argv[0]);
+      exit(1);
+    }
+  }
+  
+  picoev_init(num_conns * 2 + 16);
+  printf("mode,conns,run,iterations,requests,usec,ns_per_request\n");
+  for (run = 0; run < num_runs; ++run) {
+    for (mode = 0; mode < 3; ++mode) {
+      bench(names[mode], run);
+    }
+  }
+  picoev_deinit();
+  return 0;
+}
@@ -73,7 +73,7 @@ static void rw_callback(picoev_loop* loop, int fd, int events, void* cb_arg)
     /* update timeout, and read */
     char buf[1024];
     ssize_t r;
-    picoev_set_timeout(loop, fd, TIMEOUT_SECS);
+    picoev_refresh_timeout(loop, fd, TIMEOUT_SECS);
     r = read(fd, buf, sizeof(buf));
     switch (r) {
     case 0: /* connection closed by peer */
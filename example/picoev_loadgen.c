@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Load generator for picoev_echo (or any echo server).
+ *
+ * Opens num_conns connections spread over num_loops loops (one thread each)
+ * and sends fixed-size requests, each connection keeping one request in
+ * flight. Without -R the traffic is closed-loop (the next request is sent
+ * as soon as the response arrives); with -R the requests are scheduled at
+ * the given aggregate rate, and the latency is also reported from the time
+ * each request was scheduled to be sent, correcting the coordinated
+ * omission that occurs when the server falls behind.
+ *
+ * usage: picoev_loadgen [-h host] [-p port] [-c num_conns] [-l num_loops]
+ *                       [-d duration_secs] [-s request_size] [-R rate]
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "picoev.h"
+
+#define MAX_FDS 65536
+#define MAX_REQUEST_SIZE 65536
+
+/* log-linear histogram in nsec: values below 2^HIST_SUB_BITS are exact,
+   larger ones are kept with HIST_SUB_BITS bits of precision */
+#define HIST_SUB_BITS 6
+#define HIST_SUB_SIZE (1 << HIST_SUB_BITS)
+#define HIST_SIZE (HIST_SUB_SIZE * 2 + (64 - HIST_SUB_BITS - 1) * HIST_SUB_SIZE)
+
+typedef struct loadgen_loop_st loadgen_loop;
+
+typedef struct loadgen_conn_st {
+  loadgen_loop* owner;
+  int fd;
+  int in_flight;
+  size_t received;
+  unsigned long long sent_at; /* when the outstanding request was sent */
+  unsigned long long intended_at; /* ... when it should have been sent */
+  unsigned long long next_at; /* when the next request is due (-R only) */
+} loadgen_conn;
+
+struct loadgen_loop_st {
+  pthread_t tid;
+  picoev_loop* loop;
+  loadgen_conn* conns;
+  int num_conns;
+  unsigned long long requests;
+  unsigned long long errors;
+  unsigned long long corrected_hist[HIST_SIZE]; /* from intended_at */
+  unsigned long long raw_hist[HIST_SIZE]; /* from sent_at */
+};
+
+static const char* host = "127.0.0.1";
+static int port = 23456, num_conns = 16, num_loops = 1, duration = 10;
+static size_t request_size = 64;
+static double rate; /* requests / sec in total, 0 if closed-loop */
+static unsigned long long interval_nsec; /* per connection */
+static unsigned long long start_at, end_at;
+static char request[MAX_REQUEST_SIZE];
+
+static unsigned long long now_nsec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_index(unsigned long long v)
+{
+  int msb;
+  if (v < HIST_SUB_SIZE * 2) {
+    return (int)v;
+  }
+  msb = 63 - __builtin_clzll(v);
+  return HIST_SUB_SIZE * 2 + (msb - HIST_SUB_BITS - 1) * HIST_SUB_SIZE
+    + (int)((v >> (msb - HIST_SUB_BITS)) - HIST_SUB_SIZE);
+}
+
+static unsigned long long hist_value(int idx)
+{
+  int msb;
+  if (idx < HIST_SUB_SIZE * 2) {
+    return idx;
+  }
+  idx -= HIST_SUB_SIZE * 2;
+  msb = idx / HIST_SUB_SIZE + HIST_SUB_BITS + 1;
+  /* upper bound of the bucket */
+  return ((unsigned long long)(idx % HIST_SUB_SIZE + HIST_SUB_SIZE + 1)
+	  << (msb - HIST_SUB_BITS)) - 1;
+}
+
+static unsigned long long hist_percentile(const unsigned long long* hist,
+					  double percentile)
+{
+  unsigned long long total = 0, rank, seen = 0;
+  int i;
+  for (i = 0; i < HIST_SIZE; ++i) {
+    total += hist[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  rank = (unsigned long long)(total * percentile / 100);
+  if (rank >= total) {
+    rank = total - 1;
+  }
+  for (i = 0; i < HIST_SIZE - 1; ++i) {
+    if ((seen += hist[i]) > rank) {
+      break;
+    }
+  }
+  return hist_value(i);
+}
+
+static void close_conn(loadgen_conn* conn)
+{
+  picoev_del(conn->owner->loop, conn->fd);
+  close(conn->fd);
+  conn->fd = -1;
+  ++conn->owner->errors;
+}
+
+static void send_request(loadgen_conn* conn, unsigned long long intended_at)
+{
+  conn->intended_at = intended_at;
+  conn->sent_at = now_nsec();
+  conn->received = 0;
+  conn->in_flight = 1;
+  if (write(conn->fd, request, request_size) != (ssize_t)request_size) {
+    close_conn(conn);
+  }
+}
+
+static void read_callback(picoev_loop* loop __attribute__((unused)), int fd,
+			  int revents, void* cb_arg)
+{
+  loadgen_conn* conn = (loadgen_conn*)cb_arg;
+  char buf[MAX_REQUEST_SIZE];
+  unsigned long long now;
+  ssize_t r;
+
+  if ((revents & PICOEV_READ) == 0) {
+    return;
+  }
+  if ((r = read(fd, buf, sizeof(buf))) <= 0) {
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    close_conn(conn);
+    return;
+  }
+  if ((conn->received += r) < request_size) {
+    return;
+  }
+
+  /* got the whole response */
+  now = now_nsec();
+  conn->in_flight = 0;
+  if (now < end_at) {
+    ++conn->owner->requests;
+    ++conn->owner->corrected_hist[hist_index(now - conn->intended_at)];
+    ++conn->owner->raw_hist[hist_index(now - conn->sent_at)];
+  }
+  if (rate == 0) {
+    send_request(conn, now);
+  } else {
+    conn->next_at += interval_nsec;
+    if (conn->next_at <= now) {
+      /* behind schedule, send immediately but account the delay */
+      send_request(conn, conn->next_at);
+    }
+  }
+}
+
+static void* loop_main(void* _l)
+{
+  loadgen_loop* l = (loadgen_loop*)_l;
+  unsigned long long now;
+  int i;
+
+  for (i = 0; i < l->num_conns; ++i) {
+    loadgen_conn* conn = l->conns + i;
+    picoev_add(l->loop, conn->fd, PICOEV_READ, 0, read_callback, conn);
+    if (rate == 0) {
+      send_request(conn, now_nsec());
+    } else {
+      /* spread the first requests over one interval */
+      conn->next_at = start_at + interval_nsec * i / l->num_conns;
+    }
+  }
+
+  while ((now = now_nsec()) < end_at) {
+    if (rate == 0) {
+      picoev_loop_once(l->loop, 1);
+    } else {
+      /* timeouts are too coarse for pacing, so spin */
+      picoev_loop_once(l->loop, 0);
+      for (i = 0; i < l->num_conns; ++i) {
+	loadgen_conn* conn = l->conns + i;
+	if (conn->fd != -1 && ! conn->in_flight && conn->next_at <= now) {
+	  send_request(conn, conn->next_at);
+	}
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static int connect_to_server(void)
+{
+  struct sockaddr_in addr;
+  int fd, on = 1;
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1
+      || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  return fd;
+}
+
+static void print_row(const char* measurement, double secs,
+		      unsigned long long requests, unsigned long long errors,
+		      const unsigned long long* hist)
+{
+  printf("%s,%d,%d,%zu,%.0f,%llu,%llu,%.0f,%.1f,%.1f,%.1f,%.1f\n",
+	 measurement, num_conns, num_loops, request_size, rate, requests,
+	 errors, requests / secs, hist_percentile(hist, 50) / 1000.0,
+	 hist_percentile(hist, 99) / 1000.0,
+	 hist_percentile(hist, 99.9) / 1000.0,
+	 hist_percentile(hist, 100) / 1000.0);
+}
+
+int main(int argc, char** argv)
+{
+  loadgen_loop* loops;
+  loadgen_conn* conns;
+  unsigned long long requests = 0, errors = 0;
+  unsigned long long* corrected_hist, * raw_hist;
+  int i, j, ch;
+
+  while ((ch = getopt(argc, argv, "h:p:c:l:d:s:R:")) != -1) {
+    switch (ch) {
+    case 'h':
+      host = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'c':
+      num_conns = atoi(optarg);
+      break;
+    case 'l':
+      num_loops = atoi(optarg);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 's':
+      request_size = atoi(optarg);
+      break;
+    case 'R':
+      rate = atof(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-h host] [-p port] [-c num_conns]"
+	      " [-l num_loops] [-d duration_secs] [-s request_size]"
+	      " [-R rate]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (num_loops < 1 || num_conns < num_loops || request_size == 0
+      || request_size > MAX_REQUEST_SIZE) {
+    fprintf(stderr, "invalid arguments\n");
+    exit(1);
+  }
+  memset(request, 'a', request_size);
+  if (rate != 0) {
+    interval_nsec = (unsigned long long)(1e9 * num_conns / rate);
+  }
+
+  picoev_init(MAX_FDS);
+  loops = (loadgen_loop*)calloc(num_loops, sizeof(loadgen_loop));
+  conns = (loadgen_conn*)calloc(num_conns, sizeof(loadgen_conn));
+  assert(loops != NULL && conns != NULL);
+  for (i = 0; i < num_conns; ++i) {
+    if ((conns[i].fd = connect_to_server()) == -1) {
+      perror("failed to connect");
+      exit(1);
+    }
+    conns[i].owner = loops + i % num_loops;
+  }
+  /* loops are created here since picoev_create_loop is not thread-safe */
+  for (i = 0; i < num_loops; ++i) {
+    loops[i].loop = picoev_create_loop(60);
+    loops[i].conns = (loadgen_conn*)calloc(num_conns / num_loops + 1,
+					   sizeof(loadgen_conn));
+    assert(loops[i].loop != NULL && loops[i].conns != NULL);
+  }
+  for (i = 0; i < num_conns; ++i) {
+    loadgen_loop* l = conns[i].owner;
+    l->conns[l->num_conns] = conns[i];
+    l->conns[l->num_conns++].owner = l;
+  }
+
+  start_at = now_nsec();
+  end_at = start_at + (unsigned long long)duration * 1000000000;
+  for (i = 0; i < num_loops; ++i) {
+    pthread_create(&loops[i].tid, NULL, loop_main, loops + i);
+  }
+  corrected_hist = (unsigned long long*)calloc(HIST_SIZE,
+					       sizeof(unsigned long long));
+  raw_hist = (unsigned long long*)calloc(HIST_SIZE,
+					 sizeof(unsigned long long));
+  assert(corrected_hist != NULL && raw_hist != NULL);
+  for (i = 0; i < num_loops; ++i) {
+    pthread_join(loops[i].tid, NULL);
+    requests += loops[i].requests;
+    errors += loops[i].errors;
+    for (j = 0; j < HIST_SIZE; ++j) {
+      corrected_hist[j] += loops[i].corrected_hist[j];
+      raw_hist[j] += loops[i].raw_hist[j];
+    }
+  }
+
+  printf("measurement,conns,loops,size,rate,requests,errors,rps,"
+	 "p50_usec,p99_usec,p999_usec,max_usec\n");
+  print_row("corrected", duration, requests, errors, corrected_hist);
+  print_row("uncorrected", duration, requests, errors, raw_hist);
+
+  return 0;
+}
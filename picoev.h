@@ -41,6 +41,7 @@ extern "C" {
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 #include <time.h>
 
 #define PICOEV_IS_INITED (picoev.max_fd != 0)  
@@ -55,12 +56,88 @@ extern "C" {
 #define PICOEV_TIMEOUT_VEC_OF_VEC_OF(loop, idx) \
   ((loop)->timeout.vec_of_vec + (idx) * picoev.timeout_vec_of_vec_size)
 #define PICOEV_RND_UP(v, d) (((v) + (d) - 1) / (d) * (d))
+#define PICOEV_TIMEOUT_TABLE_SIZE /* vec_of_vec and vec of a loop */ \
+  ((picoev.timeout_vec_of_vec_size + picoev.timeout_vec_size) \
+   * sizeof(short) * PICOEV_TIMEOUT_VEC_SIZE)
+#define PICOEV_ACTIVE_TABLE_SIZE /* same for the active fds */ \
+  ((picoev.active_vec_of_vec_size + picoev.active_vec_size) \
+   * sizeof(unsigned long))
+
+#ifndef PICOEV_PREFETCH
+# ifdef __GNUC__
+#  define PICOEV_PREFETCH(addr) __builtin_prefetch(addr)
+# else
+#  define PICOEV_PREFETCH(addr) ((void)0)
+# endif
+#endif
+#ifdef __GNUC__
+# define PICOEV_CTZL(x) __builtin_ctzl(x)
+#else
+# define PICOEV_CTZL(x) picoev_ctzl_internal(x)
+#endif
+#ifndef PICOEV_PREFETCH_DISTANCE
+# define PICOEV_PREFETCH_DISTANCE 8 /* events looked ahead by the dispatch */
+#endif
+
+#ifndef PICOEV_SPLIT_FDS
+# define PICOEV_SPLIT_FDS 0 /* set to 1 to move the fields of picoev_fd not
+			       used for dispatching into picoev.fds_cold */
+#endif
+#if PICOEV_SPLIT_FDS
+# define PICOEV_FD_COLD(fd) (picoev.fds_cold + (fd))
+#else
+# define PICOEV_FD_COLD(fd) (picoev.fds + (fd))
+#endif
+
+#ifndef PICOEV_STATS
+# define PICOEV_STATS 1 /* set to 0 to remove the counters from the code */
+#endif
+#if PICOEV_STATS
+# define PICOEV_STATS_ADD(loop, counter, n) ((loop)->stats.counter += (n))
+#else
+# define PICOEV_STATS_ADD(loop, counter, n) ((void)0)
+#endif
+
+/* static tracepoints (USDT) for perf / bpftrace, define PICOEV_USDT to
+   enable (requires sys/sdt.h) */
+#ifdef PICOEV_USDT
+# include <sys/sdt.h>
+# define PICOEV_PROBE1(name, a1) DTRACE_PROBE1(picoev, name, a1)
+# define PICOEV_PROBE2(name, a1, a2) DTRACE_PROBE2(picoev, name, a1, a2)
+# define PICOEV_PROBE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(picoev, name, a1, a2, a3)
+#else
+# define PICOEV_PROBE1(name, a1) ((void)0)
+# define PICOEV_PROBE2(name, a1, a2) ((void)0)
+# define PICOEV_PROBE3(name, a1, a2, a3) ((void)0)
+#endif
+
+/* builds with several backends (PICOEV_MULTI_BACKEND, see picoev_backend.c)
+   compile each backend with its entry points renamed to picoev_<name>_*,
+   the public ones dispatching to the backend of the loop */
+#if defined(PICOEV_MULTI_BACKEND) && defined(PICOEV_BACKEND_NAME)
+# define PICOEV_BACKEND_SYM(sym) PICOEV_BACKEND_SYM_(PICOEV_BACKEND_NAME, sym)
+# define PICOEV_BACKEND_SYM_(name, sym) PICOEV_BACKEND_SYM__(name, sym)
+# define PICOEV_BACKEND_SYM__(name, sym) picoev_##name##_##sym
+# define picoev_create_loop PICOEV_BACKEND_SYM(create_loop)
+# define picoev_destroy_loop PICOEV_BACKEND_SYM(destroy_loop)
+# define picoev_signal_add PICOEV_BACKEND_SYM(signal_add)
+# define picoev_signal_del PICOEV_BACKEND_SYM(signal_del)
+# define picoev_update_events_internal PICOEV_BACKEND_SYM(update_events)
+# define picoev_update_events_many_internal \
+  PICOEV_BACKEND_SYM(update_events_many)
+# define picoev_poll_once_internal PICOEV_BACKEND_SYM(poll_once)
+#endif
+
+#define PICOEV_STATS_HIST_SIZE 32 /* log2 buckets in nsec, up to ~2 secs */
 
 #define PICOEV_PAGE_SIZE 4096
+#define PICOEV_HUGE_PAGE_SIZE (2 * 1024 * 1024)
 #define PICOEV_CACHE_LINE_SIZE 32 /* in bytes, ok if greater than the actual */
 #define PICOEV_SIMD_BITS 128
 #define PICOEV_TIMEOUT_VEC_SIZE 128
 #define PICOEV_SHORT_BITS (sizeof(short) * 8)
+#define PICOEV_LONG_BITS (sizeof(long) * 8)
 
 #define PICOEV_READ 1
 #define PICOEV_WRITE 2
@@ -71,13 +148,114 @@ extern "C" {
   
 #define PICOEV_TIMEOUT_IDX_UNUSED (UCHAR_MAX)
   
+/* kinds of tables allocated through picoev_set_allocator */
+#define PICOEV_ALLOC_FDS 1 /* picoev.fds, shared by all loops */
+#define PICOEV_ALLOC_TIMEOUT 2 /* timeout vectors of a loop */
+#define PICOEV_ALLOC_ACTIVE 3 /* active fd bitmaps of a loop */
+#define PICOEV_ALLOC_SCRATCH 4 /* chunks of the scratch arena of a loop */
+#define PICOEV_ALLOC_READ 5 /* read handlers and buffers of a loop */
+#define PICOEV_ALLOC_RATE 6 /* rate limits of a loop */
+
+/* units of picoev_set_rate_limit */
+#define PICOEV_RATE_BYTES 0 /* charged by picoev_rate_consume */
+#define PICOEV_RATE_EVENTS 1 /* one per event dispatched */
+
+#define PICOEV_LISTENER_MAX_BACKOFF 32 /* in secs */
+#define PICOEV_LISTENER_PAUSED_LIMIT 1 /* at max_conns */
+#define PICOEV_LISTENER_PAUSED_BACKOFF 2 /* after running out of fds */
+
+#define PICOEV_HANDOFF_MAX_FDS 250 /* per message, below SCM_MAX_FD */
+
+#ifndef PICOEV_READ_BUF_SIZE
+# define PICOEV_READ_BUF_SIZE (16 * 1024) /* of picoev_read_start */
+#endif
+
+#ifndef PICOEV_SCRATCH_CHUNK_SIZE
+# define PICOEV_SCRATCH_CHUNK_SIZE (64 * 1024) /* unless larger requested */
+#endif
+#define PICOEV_SCRATCH_ALIGN 16 /* of picoev_scratch_alloc */
+#define PICOEV_SCRATCH_HDR_SIZE \
+  PICOEV_RND_UP(sizeof(picoev_scratch_chunk), PICOEV_SCRATCH_ALIGN)
+  
   typedef unsigned short picoev_loop_id_t;
   
   typedef struct picoev_loop_st picoev_loop;
   
+  /* header of a chunk of the scratch arena, followed by the data */
+  typedef struct picoev_scratch_chunk_st {
+    struct picoev_scratch_chunk_st* next;
+    size_t size; /* including the header */
+  } picoev_scratch_chunk;
+  
   typedef void picoev_handler(picoev_loop* loop, int fd, int revents,
 			      void* cb_arg);
   
+  /* token bucket of picoev_set_rate_limit */
+  typedef struct picoev_rate_bucket_st {
+    long long tokens; /* negative after a charge larger than the balance */
+    unsigned rate; /* per sec, 0 if not limited */
+    unsigned burst; /* capacity */
+  } picoev_rate_bucket;
+  
+  /* rate limits of an fd, buckets[0] for PICOEV_READ and buckets[1] for
+     PICOEV_WRITE */
+  typedef struct picoev_rate_limit_st {
+    picoev_rate_bucket buckets[2];
+    time_t refilled_at;
+    time_t timeout_at; /* of the application, kept aside while throttled */
+    char limited; /* events having a bucket, 0 if not limited */
+    char per_event; /* events charged one token per event */
+    char events; /* watched by the application */
+    char throttled; /* cleared from the interest for lack of tokens */
+  } picoev_rate_limit;
+  
+  typedef void picoev_signal_handler(picoev_loop* loop, int signo,
+				     void* cb_arg);
+  
+  typedef void picoev_child_handler(picoev_loop* loop, pid_t pid, int status,
+				    void* cb_arg);
+  
+  /* called with a connection accepted by a listener, in non-blocking mode */
+  typedef void picoev_accept_handler(picoev_loop* loop, int fd, void* cb_arg);
+  
+  /* called with the data read (len > 0), 0 on EOF, or -1 on error with
+     errno set (ETIMEDOUT on timeout) */
+  typedef void picoev_data_handler(picoev_loop* loop, int fd, char* buf,
+				   ssize_t len, void* cb_arg);
+  
+  /* allocates zero-filled memory of sz bytes, returns NULL on failure */
+  typedef void* picoev_alloc_handler(size_t sz, int kind, void* arg);
+  
+  typedef void picoev_free_handler(void* p, size_t sz, int kind, void* arg);
+  
+  typedef void picoev_slow_callback_handler(picoev_loop* loop, int fd,
+					    picoev_handler* callback,
+					    unsigned long long nsec,
+					    void* hook_arg);
+  
+  typedef struct picoev_stats_st {
+    unsigned long long iterations; /* # of calls to picoev_loop_once */
+    unsigned long long events; /* # of I/O events dispatched */
+    unsigned long long empty_polls; /* # of polls that returned no events */
+    unsigned long long blocked_nsec; /* time spent in epoll_wait, etc. */
+    unsigned long long timeouts; /* # of timeouts fired */
+    unsigned long long backend_calls; /* # of epoll_ctl calls, etc. */
+    unsigned max_events_per_poll; /* high-water mark */
+    /* histograms below are only recorded while enabled by
+       picoev_profile_callbacks, bucket i counts [2^i, 2^(i+1)) nsec */
+    unsigned long long callback_hist[PICOEV_STATS_HIST_SIZE]; /* duration */
+    /* time from the poll returning to the dispatch of each event */
+    unsigned long long dispatch_lag_hist[PICOEV_STATS_HIST_SIZE];
+    /* time from the expiry of a timeout slot to its handling */
+    unsigned long long timeout_lag_hist[PICOEV_STATS_HIST_SIZE];
+  } picoev_stats;
+  
+  /* fields not used for dispatching, access through PICOEV_FD_COLD(fd) */
+#define PICOEV_FD_COLD_FIELDS						\
+  unsigned char timeout_idx; /* PICOEV_TIMEOUT_IDX_UNUSED if not used */ \
+  int _backend; /* can be used by backends (never modified by core) */	\
+  time_t timeout_at; /* deadline, may be later than the armed slot */
+  
   typedef struct picoev_fd_st {
     /* use accessors! */
     /* TODO adjust the size to match that of a cache line */
@@ -85,10 +263,19 @@ extern "C" {
     void* cb_arg;
     picoev_loop_id_t loop_id;
     char events;
-    unsigned char timeout_idx; /* PICOEV_TIMEOUT_IDX_UNUSED if not used */
-    int _backend; /* can be used by backends (never modified by core) */
+#if ! PICOEV_SPLIT_FDS
+    PICOEV_FD_COLD_FIELDS
+#endif
   } picoev_fd;
   
+#if PICOEV_SPLIT_FDS
+  typedef struct picoev_fd_cold_st {
+    PICOEV_FD_COLD_FIELDS
+  } picoev_fd_cold;
+#else
+  typedef picoev_fd picoev_fd_cold;
+#endif
+  
   struct picoev_loop_st {
     /* read only */
     picoev_loop_id_t loop_id;
@@ -99,34 +286,218 @@ extern "C" {
       time_t base_time;
       int resolution;
       void* _free_addr;
+      unsigned num_armed[PICOEV_TIMEOUT_VEC_SIZE]; /* # of fds in each slot */
     } timeout;
+    /* registered fds, bit (fd % PICOEV_LONG_BITS) of vec[fd /
+       PICOEV_LONG_BITS], each bit of vec_of_vec telling if a word of vec is
+       non-zero */
+    struct {
+      unsigned long* vec;
+      unsigned long* vec_of_vec;
+      void* _free_addr;
+      int count;
+    } active;
+    /* arena of picoev_scratch_alloc, the chunks being kept for reuse */
+    struct {
+      char* ptr;
+      char* end;
+      picoev_scratch_chunk* cur;
+      picoev_scratch_chunk* chunks;
+    } scratch;
+    /* completion-style reads (picoev_read_start) */
+    struct {
+      picoev_data_handler** handlers; /* by fd, allocated on first use */
+      void* _free_addr;
+      void* free_bufs; /* buffer pool, linked through the first word */
+    } read;
+    /* token buckets (picoev_set_rate_limit) */
+    struct {
+      picoev_rate_limit* limits; /* by fd, allocated on first use */
+      void* _free_addr;
+    } rate;
     time_t now;
+    picoev_stats stats; /* always present so that the layout is stable */
+    struct {
+      int enabled;
+      unsigned long long threshold_nsec;
+      picoev_slow_callback_handler* hook;
+      void* hook_arg;
+      unsigned long long polled_at; /* when the last poll returned */
+    } profile;
+    /* NULL unless built with PICOEV_MULTI_BACKEND */
+    const struct picoev_backend_st* backend;
   };
   
+  /* a listening socket accepting under admission control, see
+     picoev_listener_add */
+  typedef struct picoev_listener_st {
+    /* read only */
+    picoev_loop* loop;
+    int fd;
+    int reserve_fd; /* closed to accept and drop a connection on EMFILE */
+    int paused; /* PICOEV_LISTENER_PAUSED_* */
+    int backoff_secs; /* of the last pause, 0 once accept succeeds */
+    int num_conns; /* accepted and not yet released */
+    int max_conns; /* 0 if unlimited */
+    int resume_conns;
+    unsigned long long num_accepted;
+    unsigned long long num_dropped; /* closed at once for lack of fds */
+    picoev_accept_handler* callback;
+    void* cb_arg;
+  } picoev_listener;
+  
   typedef struct picoev_globals_st {
     /* read only */
     picoev_fd* fds;
     void* _fds_free_addr;
+#if PICOEV_SPLIT_FDS
+    picoev_fd_cold* fds_cold; /* parallel to fds */
+    void* _fds_cold_free_addr;
+#endif
     int max_fd;
     int num_loops;
     size_t timeout_vec_size; /* # of elements in picoev_loop.timeout.vec[0] */
     size_t timeout_vec_of_vec_size; /* ... in timeout.vec_of_vec[0] */
+    size_t active_vec_size; /* # of elements in picoev_loop.active.vec */
+    size_t active_vec_of_vec_size; /* ... in active.vec_of_vec */
+    struct {
+      picoev_alloc_handler* alloc; /* NULL to use picoev_default_alloc */
+      picoev_free_handler* dealloc;
+      void* arg;
+    } allocator;
   } picoev_globals;
   
   extern picoev_globals picoev;
   
-  /* creates a new event loop (defined by each backend) */
+  /* operations of a backend, for builds with several of them */
+  typedef struct picoev_backend_st {
+    const char* name; /* "epoll", "kqueue" or "select" */
+    picoev_loop* (*create_loop)(int max_timeout);
+    int (*destroy_loop)(picoev_loop* loop);
+    int (*update_events)(picoev_loop* loop, int fd, int events);
+    int (*update_events_many)(picoev_loop* loop, const int* fds,
+			      const int* events, int flags, int n);
+    int (*poll_once)(picoev_loop* loop, int max_wait);
+    int (*signal_add)(picoev_loop* loop, int signo,
+		      picoev_signal_handler* callback, void* cb_arg);
+    int (*signal_del)(picoev_loop* loop, int signo);
+  } picoev_backend;
+  
+  /* creates a new event loop (defined by each backend). In builds with
+     several backends, the first one (in the order of epoll or kqueue, then
+     select) that succeeds in creating a loop is used */
   picoev_loop* picoev_create_loop(int max_timeout);
   
+#ifdef PICOEV_MULTI_BACKEND
+  /* returns the backend of given name, or NULL if it was not compiled in */
+  const picoev_backend* picoev_find_backend(const char* name);
+  
+  /* creates a new event loop using given backend */
+  picoev_loop* picoev_create_loop_with_backend(const picoev_backend* backend,
+					       int max_timeout);
+#endif
+  
   /* destroys a loop (defined by each backend) */
   int picoev_destroy_loop(picoev_loop* loop);
   
+  /* registers a signal handler to a loop; the signal is blocked (or caught)
+     and delivered as an ordinary callback from picoev_loop_once. Should be
+     called before other threads are spawned. With the select backend, a
+     signal can be registered to only one loop at a time, -1 being returned
+     if another loop has it (defined by each backend) */
+  int picoev_signal_add(picoev_loop* loop, int signo,
+			picoev_signal_handler* callback, void* cb_arg);
+  
+  /* unregisters a signal handler (defined by each backend) */
+  int picoev_signal_del(picoev_loop* loop, int signo);
+  
+  /* watches a child process and calls the handler with the status returned
+     by waitpid once it exits, or -1 if it could not be waited for (e.g. when
+     reaped elsewhere, errno being set). Uses pidfd where available, otherwise
+     falls back to a SIGCHLD reaper that is limited to a single loop (defined
+     in picoev_child.c) */
+  int picoev_child_add(picoev_loop* loop, pid_t pid,
+		       picoev_child_handler* callback, void* cb_arg);
+  
+  /* accepts connections from a listening socket (made non-blocking),
+     calling the handler for each. When out of fds (EMFILE, ENFILE, or an fd
+     beyond picoev.max_fd) the pending connection is accepted with the help
+     of a reserved fd and closed, and the listener pauses for 1 sec, doubling
+     up to PICOEV_LISTENER_MAX_BACKOFF while the shortage lasts, instead of
+     spinning on accept. The handler must not delete the listener. Not
+     available on Windows (defined in picoev_listener.c) */
+  picoev_listener* picoev_listener_add(picoev_loop* loop, int fd,
+				       picoev_accept_handler* callback,
+				       void* cb_arg);
+  
+  /* unregisters and frees the listener, leaving fd open */
+  void picoev_listener_del(picoev_listener* listener);
+  
+  /* stops accepting once max_conns connections are held (0 for no limit),
+     resuming when they drop to resume_conns. Connections are counted from
+     being accepted until passed to picoev_listener_release */
+  void picoev_listener_set_limit(picoev_listener* listener, int max_conns,
+				 int resume_conns);
+  
+  /* tells the listener that one of its connections has been closed, which
+     also ends a pause for lack of fds */
+  void picoev_listener_release(picoev_listener* listener);
+  
+  /* registers fd to be read by the loop: once readable, the loop reads
+     from it into a buffer of PICOEV_READ_BUF_SIZE bytes taken from the
+     buffer pool of the loop and calls the handler, returning the buffer to
+     the pool when the handler returns. Only PICOEV_READ is watched, the
+     fd being unregistered by picoev_del. Not available on Windows (defined
+     in picoev_read.c) */
+  int picoev_read_start(picoev_loop* loop, int fd, int timeout_in_secs,
+			picoev_data_handler* callback, void* cb_arg);
+  
+  /* internal: the handler of the fds registered by picoev_read_start */
+  void picoev_read_callback_internal(picoev_loop* loop, int fd, int revents,
+				     void* cb_arg);
+  
+  /* passes n fds (listening sockets, and optionally idle connections) to
+     another process over a connected AF_UNIX socket using SCM_RIGHTS, for
+     a restart without dropping connections. The caller keeps its copies,
+     which it should unregister and close (leaving the connections pending
+     in the backlog of a listener to the receiver) before calling
+     picoev_drain. Returns -1 if failed. Not available on Windows (defined
+     in picoev_handoff.c) */
+  int picoev_handoff_send(int sock, const int* fds, int n);
+  
+  /* receives the fds sent by one call to picoev_handoff_send into fds (in
+     the same order, with close-on-exec set), returning their number, or -1
+     if failed or more than max_fds were sent (closing them all) */
+  int picoev_handoff_recv(int sock, int* fds, int max_fds);
+  
+  /* runs the loop until the connections (the registered sockets that are
+     not listening) are closed by their handlers, capping their timeouts at
+     timeout_in_secs (> 0) so that the idle ones get PICOEV_TIMEOUT by then.
+     Gives up once they should all have timed out, returning the number of
+     those still registered (to be closed by the caller), or -1 if failed */
+  int picoev_drain(picoev_loop* loop, int timeout_in_secs);
+  
   /* internal: updates events to be watched (defined by each backend) */
   int picoev_update_events_internal(picoev_loop* loop, int fd, int events);
   
+  /* internal: updates events of n fds at once, events[i] | flags being
+     given to fds[i] (events may be NULL for all zero). Backends submit the
+     changes in as few calls as they can, and leave picoev_fd::events
+     unchanged for the fds that failed (defined by each backend) */
+  int picoev_update_events_many_internal(picoev_loop* loop, const int* fds,
+					 const int* events, int flags, int n);
+  
   /* internal: poll once and call the handlers (defined by each backend) */
   int picoev_poll_once_internal(picoev_loop* loop, int max_wait);
   
+  /* default allocator of the tables (defined in picoev_alloc.c). Tables of
+     PICOEV_HUGE_PAGE_SIZE or larger are mapped using huge pages (reserved
+     ones if available, otherwise transparent) and left untouched until
+     used, so that their pages are placed on the NUMA node of the thread
+     touching them first; smaller ones are allocated by calloc */
+  void* picoev_default_alloc(size_t sz, int kind, void* arg);
+  void picoev_default_free(void* p, size_t sz, int kind, void* arg);
+  
   /* internal, aligned allocator with address scrambling to avoid cache
      line contention */
   PICOEV_INLINE
@@ -144,16 +515,88 @@ extern "C" {
 			   PICOEV_CACHE_LINE_SIZE);
   }
   
+  /* sets the allocator of all the memory picoev owns, should be called
+     before picoev_init (NULL restores the default). kind tells what is
+     allocated (see PICOEV_ALLOC_*): the fd table (FDS) by picoev_init, the
+     timeout vectors (TIMEOUT) and active fd bitmaps (ACTIVE) by
+     picoev_create_loop, and later on demand the chunks of the scratch arena
+     (SCRATCH), the read handler table and buffers (READ), and the rate limit
+     table (RATE). alloc must return zero-filled memory, as the tables are
+     not cleared after. dealloc receives the same sz and kind, and is called
+     up to picoev_destroy_loop / picoev_deinit; both must be given, or
+     neither */
+  PICOEV_INLINE
+  void picoev_set_allocator(picoev_alloc_handler* alloc,
+			    picoev_free_handler* dealloc, void* arg) {
+    assert(! PICOEV_IS_INITED);
+    assert((alloc == NULL) == (dealloc == NULL));
+    picoev.allocator.alloc = alloc;
+    picoev.allocator.dealloc = dealloc;
+    picoev.allocator.arg = arg;
+  }
+  
+  /* internal: allocates memory through the allocator */
+  PICOEV_INLINE
+  void* picoev_alloc_internal(size_t sz, int kind) {
+    return picoev.allocator.alloc != NULL
+      ? picoev.allocator.alloc(sz, kind, picoev.allocator.arg)
+      : picoev_default_alloc(sz, kind, NULL);
+  }
+  
+  /* internal */
+  PICOEV_INLINE
+  void picoev_free_internal(void* p, size_t sz, int kind) {
+    if (picoev.allocator.alloc != NULL) {
+      picoev.allocator.dealloc(p, sz, kind, picoev.allocator.arg);
+    } else {
+      picoev_default_free(p, sz, kind, NULL);
+    }
+  }
+  
+  /* internal, allocates a table through the allocator, scrambled like
+     picoev_memalign */
+  PICOEV_INLINE
+  void* picoev_alloc_table_internal(size_t sz, int kind, void** orig_addr) {
+    sz = sz + PICOEV_PAGE_SIZE + PICOEV_CACHE_LINE_SIZE;
+    if ((*orig_addr = picoev_alloc_internal(sz, kind)) == NULL) {
+      return NULL;
+    }
+    return
+      (void*)PICOEV_RND_UP((unsigned long)*orig_addr
+			   + (rand() % PICOEV_PAGE_SIZE),
+			   PICOEV_CACHE_LINE_SIZE);
+  }
+  
+  /* internal */
+  PICOEV_INLINE
+  void picoev_free_table_internal(void* orig_addr, size_t sz, int kind) {
+    picoev_free_internal(orig_addr,
+			 sz + PICOEV_PAGE_SIZE + PICOEV_CACHE_LINE_SIZE, kind);
+  }
+  
   /* initializes picoev */
   PICOEV_INLINE
   int picoev_init(int max_fd) {
     assert(! PICOEV_IS_INITED);
     assert(max_fd > 0);
-    if ((picoev.fds = (picoev_fd*)picoev_memalign(sizeof(picoev_fd) * max_fd,
-						  &picoev._fds_free_addr, 1))
+    if ((picoev.fds
+	 = (picoev_fd*)picoev_alloc_table_internal(sizeof(picoev_fd) * max_fd,
+						   PICOEV_ALLOC_FDS,
+						   &picoev._fds_free_addr))
 	== NULL) {
       return -1;
     }
+#if PICOEV_SPLIT_FDS
+    if ((picoev.fds_cold
+	 = (picoev_fd_cold*)picoev_alloc_table_internal(
+	     sizeof(picoev_fd_cold) * max_fd, PICOEV_ALLOC_FDS,
+	     &picoev._fds_cold_free_addr))
+	== NULL) {
+      picoev_free_table_internal(picoev._fds_free_addr,
+				 sizeof(picoev_fd) * max_fd, PICOEV_ALLOC_FDS);
+      return -1;
+    }
+#endif
     picoev.max_fd = max_fd;
     picoev.num_loops = 0;
     picoev.timeout_vec_size
@@ -161,6 +604,11 @@ extern "C" {
     picoev.timeout_vec_of_vec_size
       = PICOEV_RND_UP(picoev.timeout_vec_size, PICOEV_SIMD_BITS)
       / PICOEV_SHORT_BITS;
+    picoev.active_vec_size
+      = PICOEV_RND_UP(picoev.max_fd, PICOEV_LONG_BITS) / PICOEV_LONG_BITS;
+    picoev.active_vec_of_vec_size
+      = PICOEV_RND_UP(picoev.active_vec_size, PICOEV_LONG_BITS)
+      / PICOEV_LONG_BITS;
     return 0;
   }
   
@@ -168,23 +616,32 @@ extern "C" {
   PICOEV_INLINE
   int picoev_deinit(void) {
     assert(PICOEV_IS_INITED);
-    free(picoev._fds_free_addr);
+    picoev_free_table_internal(picoev._fds_free_addr,
+			       sizeof(picoev_fd) * picoev.max_fd,
+			       PICOEV_ALLOC_FDS);
     picoev.fds = NULL;
     picoev._fds_free_addr = NULL;
+#if PICOEV_SPLIT_FDS
+    picoev_free_table_internal(picoev._fds_cold_free_addr,
+			       sizeof(picoev_fd_cold) * picoev.max_fd,
+			       PICOEV_ALLOC_FDS);
+    picoev.fds_cold = NULL;
+    picoev._fds_cold_free_addr = NULL;
+#endif
     picoev.max_fd = 0;
     picoev.num_loops = 0;
     return 0;
   }
   
-  /* updates timeout */
+  /* internal: updates timeout, regardless of the rate limits */
   PICOEV_INLINE
-  void picoev_set_timeout(picoev_loop* loop, int fd, int secs) {
-    picoev_fd* target;
+  void picoev_set_timeout_internal(picoev_loop* loop, int fd, int secs) {
+    picoev_fd_cold* target;
     short* vec, * vec_of_vec;
     size_t vi = fd / PICOEV_SHORT_BITS, delta;
     assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fd));
     assert(PICOEV_FD_BELONGS_TO_LOOP(loop, fd));
-    target = picoev.fds + fd;
+    target = PICOEV_FD_COLD(fd);
     /* clear timeout */
     if (target->timeout_idx != PICOEV_TIMEOUT_IDX_UNUSED) {
       vec = PICOEV_TIMEOUT_VEC_OF(loop, target->timeout_idx);
@@ -194,9 +651,12 @@ extern "C" {
 	vec_of_vec[vi / PICOEV_SHORT_BITS]
 	  &= ~((unsigned short)SHRT_MIN >> (vi % PICOEV_SHORT_BITS));
       }
+      --loop->timeout.num_armed[target->timeout_idx];
       target->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
     }
-    if (secs != 0) {
+    if (secs == 0) {
+      PICOEV_PROBE2(set_timeout, fd, -1);
+    } else {
       delta = (loop->now + secs - loop->timeout.base_time)
 	/ loop->timeout.resolution;
       if (delta >= PICOEV_TIMEOUT_VEC_SIZE) {
@@ -204,12 +664,313 @@ extern "C" {
       }
       target->timeout_idx =
 	(loop->timeout.base_idx + delta) % PICOEV_TIMEOUT_VEC_SIZE;
+      target->timeout_at = loop->now + secs;
       vec = PICOEV_TIMEOUT_VEC_OF(loop, target->timeout_idx);
       vec[vi] |= (unsigned short)SHRT_MIN >> (fd % PICOEV_SHORT_BITS);
       vec_of_vec = PICOEV_TIMEOUT_VEC_OF_VEC_OF(loop, target->timeout_idx);
       vec_of_vec[vi / PICOEV_SHORT_BITS]
 	|= (unsigned short)SHRT_MIN >> (vi % PICOEV_SHORT_BITS);
+      ++loop->timeout.num_armed[target->timeout_idx];
+      PICOEV_PROBE2(set_timeout, fd, target->timeout_idx);
+    }
+  }
+  
+  /* internal: returns the rate limits of fd, or NULL if it has none */
+  PICOEV_INLINE
+  picoev_rate_limit* picoev_rate_limit_of_internal(picoev_loop* loop,
+						   int fd) {
+    picoev_rate_limit* limit;
+    assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fd));
+    if (loop->rate.limits == NULL) {
+      return NULL;
+    }
+    limit = loop->rate.limits + fd;
+    return limit->limited != 0 ? limit : NULL;
+  }
+  
+  /* internal: adds the tokens earned since the last refill */
+  PICOEV_INLINE
+  void picoev_rate_refill_internal(picoev_loop* loop,
+				   picoev_rate_limit* limit) {
+    time_t elapsed = loop->now - limit->refilled_at;
+    int i;
+    if (elapsed <= 0) {
+      return;
+    }
+    for (i = 0; i < 2; ++i) {
+      picoev_rate_bucket* bucket = limit->buckets + i;
+      if (bucket->rate != 0) {
+	bucket->tokens += (long long)bucket->rate * elapsed;
+	if (bucket->tokens > bucket->burst) {
+	  bucket->tokens = bucket->burst;
+	}
+      }
+    }
+    limit->refilled_at = loop->now;
+  }
+  
+  /* internal: returns the events whose bucket is empty */
+  PICOEV_INLINE
+  int picoev_rate_dry_internal(picoev_rate_limit* limit) {
+    return (limit->buckets[0].rate != 0 && limit->buckets[0].tokens <= 0
+	    ? PICOEV_READ : 0)
+      | (limit->buckets[1].rate != 0 && limit->buckets[1].tokens <= 0
+	 ? PICOEV_WRITE : 0);
+  }
+  
+  /* internal: throttles the events whose bucket is empty and restores the
+     others. While throttled, the timeout slot of the fd is armed for the
+     earliest refill (or the timeout of the application if earlier), so
+     that the fd costs nothing until then */
+  PICOEV_INLINE
+  int picoev_rate_update_internal(picoev_loop* loop, int fd,
+				  picoev_rate_limit* limit) {
+    picoev_fd_cold* cold = PICOEV_FD_COLD(fd);
+    int was_throttled = limit->throttled, events, i;
+    long long secs = 0, max_secs
+      = (long long)PICOEV_TIMEOUT_VEC_SIZE * loop->timeout.resolution;
+    limit->throttled = picoev_rate_dry_internal(limit);
+    if (limit->throttled != 0) {
+      if (was_throttled == 0) {
+	limit->timeout_at = cold->timeout_idx != PICOEV_TIMEOUT_IDX_UNUSED
+	  ? cold->timeout_at : 0;
+      }
+      for (i = 0; i < 2; ++i) {
+	picoev_rate_bucket* bucket = limit->buckets + i;
+	if ((limit->throttled & (i + 1)) != 0) {
+	  /* secs until the bucket holds a token again */
+	  long long wait = (1 - bucket->tokens + bucket->rate - 1)
+	    / bucket->rate;
+	  if (secs == 0 || wait < secs) {
+	    secs = wait;
+	  }
+	}
+      }
+      if (limit->timeout_at != 0 && limit->timeout_at - loop->now < secs) {
+	secs = limit->timeout_at - loop->now;
+      }
+      /* refilled (and re-armed) on expiry if it did not suffice */
+      picoev_set_timeout_internal(loop, fd,
+				  secs < 1 ? 1
+				  : secs > max_secs ? (int)max_secs
+				  : (int)secs);
+    } else if (was_throttled != 0) {
+      /* give the slot back to the timeout of the application */
+      secs = limit->timeout_at != 0 ? limit->timeout_at - loop->now : 0;
+      picoev_set_timeout_internal(loop, fd,
+				  limit->timeout_at == 0 ? 0
+				  : secs < 1 ? 1 : (int)secs);
+      limit->timeout_at = 0;
+    }
+    events = limit->events & ~limit->throttled;
+    if (picoev.fds[fd].events != events) {
+      return picoev_update_events_internal(loop, fd, events);
+    }
+    return 0;
+  }
+  
+  /* internal: charges the events dispatched to a rate-limited fd, and
+     returns those to be passed to its handler (0 for none) */
+  PICOEV_INLINE
+  int picoev_rate_dispatch_internal(picoev_loop* loop, int fd,
+				    picoev_rate_limit* limit, int revents) {
+    int i;
+    picoev_rate_refill_internal(loop, limit);
+    if ((revents & PICOEV_TIMEOUT) != 0) {
+      if (limit->throttled == 0) {
+	return revents;
+      }
+      if (limit->timeout_at == 0 || limit->timeout_at > loop->now) {
+	/* time to refill, not a timeout of the application */
+	revents = 0;
+      } else {
+	limit->timeout_at = 0;
+      }
+      picoev_rate_update_internal(loop, fd, limit);
+      return revents;
+    }
+    for (i = 0; i < 2; ++i) {
+      picoev_rate_bucket* bucket = limit->buckets + i;
+      if ((revents & (i + 1)) != 0 && bucket->rate != 0) {
+	if (bucket->tokens <= 0) {
+	  /* polled before the interest was cleared */
+	  revents &= ~(i + 1);
+	} else if ((limit->per_event & (i + 1)) != 0) {
+	  --bucket->tokens;
+	}
+      }
+    }
+    if (picoev_rate_dry_internal(limit) != limit->throttled) {
+      picoev_rate_update_internal(loop, fd, limit);
+    }
+    return revents;
+  }
+  
+  /* internal: drops the rate limits of fd when it is unregistered */
+  PICOEV_INLINE
+  void picoev_rate_forget_internal(picoev_loop* loop, int fd) {
+    if (loop->rate.limits != NULL) {
+      loop->rate.limits[fd].limited = 0;
+    }
+  }
+  
+  /* limits the reads (PICOEV_READ) and / or writes (PICOEV_WRITE) of a
+     registered fd to rate units per sec, in bursts of up to burst units.
+     Units are the bytes passed to picoev_rate_consume by the handler, or
+     the events dispatched if unit is PICOEV_RATE_EVENTS. Once a bucket runs
+     dry the event is cleared from the interest and the fd waits on the
+     timeout wheel until the bucket refills, the timeout of the application
+     being kept aside meanwhile. As the wheel fires up to one resolution
+     late, a burst below (1 + resolution) secs worth lowers the rate; 0
+     chooses that much. rate == 0 removes the limit, which is also dropped
+     by picoev_del. Returns -1 if failed */
+  PICOEV_INLINE
+  int picoev_set_rate_limit(picoev_loop* loop, int fd, int events,
+			    unsigned rate, unsigned burst, int unit) {
+    picoev_rate_limit* limit;
+    int i;
+    assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fd));
+    assert(PICOEV_FD_BELONGS_TO_LOOP(loop, fd));
+    if (loop->rate.limits == NULL) {
+      if (rate == 0) {
+	return 0;
+      }
+      if ((loop->rate.limits = (picoev_rate_limit*)
+	   picoev_alloc_table_internal(sizeof(picoev_rate_limit)
+				       * picoev.max_fd, PICOEV_ALLOC_RATE,
+				       &loop->rate._free_addr))
+	  == NULL) {
+	return -1;
+      }
+    }
+    limit = loop->rate.limits + fd;
+    if (limit->limited == 0) {
+      if (rate == 0) {
+	return 0;
+      }
+      memset(limit, 0, sizeof(*limit));
+      limit->refilled_at = loop->now;
+      limit->events = picoev.fds[fd].events & PICOEV_READWRITE;
+    } else {
+      picoev_rate_refill_internal(loop, limit);
+    }
+    if (burst == 0) {
+      burst = rate * (1 + loop->timeout.resolution);
+    }
+    for (i = 0; i < 2; ++i) {
+      picoev_rate_bucket* bucket = limit->buckets + i;
+      if ((events & (i + 1)) == 0) {
+	continue;
+      }
+      /* a new bucket starts full */
+      if (bucket->rate == 0 || bucket->tokens > burst) {
+	bucket->tokens = burst;
+      }
+      bucket->rate = rate;
+      bucket->burst = burst;
+      if (rate != 0) {
+	limit->limited |= i + 1;
+      } else {
+	limit->limited &= ~(i + 1);
+      }
+      if (unit == PICOEV_RATE_EVENTS) {
+	limit->per_event |= i + 1;
+      } else {
+	limit->per_event &= ~(i + 1);
+      }
+    }
+    return picoev_rate_update_internal(loop, fd, limit);
+  }
+  
+  /* charges n bytes (just read or written) to the buckets of events
+     (PICOEV_READ and / or PICOEV_WRITE) of fd, throttling it if one runs
+     dry. Buckets counting events and fds not rate-limited are left alone.
+     Returns -1 if failed */
+  PICOEV_INLINE
+  int picoev_rate_consume(picoev_loop* loop, int fd, int events, size_t n) {
+    picoev_rate_limit* limit;
+    int i;
+    if ((limit = picoev_rate_limit_of_internal(loop, fd)) == NULL) {
+      return 0;
+    }
+    picoev_rate_refill_internal(loop, limit);
+    for (i = 0; i < 2; ++i) {
+      if ((events & ~limit->per_event & (i + 1)) != 0
+	  && limit->buckets[i].rate != 0) {
+	limit->buckets[i].tokens -= (long long)n;
+      }
+    }
+    if (picoev_rate_dry_internal(limit) != limit->throttled) {
+      return picoev_rate_update_internal(loop, fd, limit);
+    }
+    return 0;
+  }
+  
+  /* updates timeout */
+  PICOEV_INLINE
+  void picoev_set_timeout(picoev_loop* loop, int fd, int secs) {
+    picoev_rate_limit* limit = picoev_rate_limit_of_internal(loop, fd);
+    if (limit != NULL && limit->throttled != 0) {
+      /* the slot is used for the refill, the timeout is re-armed after */
+      limit->timeout_at = secs != 0 ? loop->now + secs : 0;
+      picoev_rate_update_internal(loop, fd, limit);
+      return;
+    }
+    picoev_set_timeout_internal(loop, fd, secs);
+  }
+  
+  /* updates timeout lazily; if the fd already sits in a slot that expires no
+     later than the new deadline, only the deadline is recorded and the fd
+     is moved to the right slot when the old one expires */
+  PICOEV_INLINE
+  void picoev_refresh_timeout(picoev_loop* loop, int fd, int secs) {
+    picoev_fd_cold* target;
+    picoev_rate_limit* limit;
+    time_t timeout_at = loop->now + secs;
+    assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fd));
+    assert(PICOEV_FD_BELONGS_TO_LOOP(loop, fd));
+    target = PICOEV_FD_COLD(fd);
+    limit = picoev_rate_limit_of_internal(loop, fd);
+    if (secs != 0 && target->timeout_idx != PICOEV_TIMEOUT_IDX_UNUSED
+	&& timeout_at >= target->timeout_at
+	&& (limit == NULL || limit->throttled == 0)) {
+      target->timeout_at = timeout_at;
+    } else {
+      picoev_set_timeout(loop, fd, secs);
+    }
+  }
+  
+#ifndef __GNUC__
+  /* internal */
+  PICOEV_INLINE
+  int picoev_ctzl_internal(unsigned long x) {
+    int n = 0;
+    for (; (x & 1) == 0; x >>= 1) {
+      ++n;
+    }
+    return n;
+  }
+#endif
+  
+  /* internal: marks fd as registered to the loop */
+  PICOEV_INLINE
+  void picoev_set_active_internal(picoev_loop* loop, int fd) {
+    size_t vi = fd / PICOEV_LONG_BITS;
+    loop->active.vec[vi] |= 1UL << (fd % PICOEV_LONG_BITS);
+    loop->active.vec_of_vec[vi / PICOEV_LONG_BITS]
+      |= 1UL << (vi % PICOEV_LONG_BITS);
+    ++loop->active.count;
+  }
+  
+  /* internal */
+  PICOEV_INLINE
+  void picoev_clear_active_internal(picoev_loop* loop, int fd) {
+    size_t vi = fd / PICOEV_LONG_BITS;
+    if ((loop->active.vec[vi] &= ~(1UL << (fd % PICOEV_LONG_BITS))) == 0) {
+      loop->active.vec_of_vec[vi / PICOEV_LONG_BITS]
+	&= ~(1UL << (vi % PICOEV_LONG_BITS));
     }
+    --loop->active.count;
   }
   
   /* registers a file descriptor and callback argument to a event loop */
@@ -224,11 +985,12 @@ extern "C" {
     target->cb_arg = cb_arg;
     target->loop_id = loop->loop_id;
     target->events = 0;
-    target->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
+    PICOEV_FD_COLD(fd)->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
     if (picoev_update_events_internal(loop, fd, events | PICOEV_ADD) != 0) {
       target->loop_id = 0;
       return -1;
     }
+    picoev_set_active_internal(loop, fd);
     picoev_set_timeout(loop, fd, timeout_in_secs);
     return 0;
   }
@@ -242,11 +1004,72 @@ extern "C" {
     if (picoev_update_events_internal(loop, fd, PICOEV_DEL) != 0) {
       return -1;
     }
+    picoev_rate_forget_internal(loop, fd);
     picoev_set_timeout(loop, fd, 0);
+    picoev_clear_active_internal(loop, fd);
     target->loop_id = 0;
     return 0;
   }
   
+  /* internal: returns if the bulk update of fd failed */
+  PICOEV_INLINE
+  int picoev_update_failed_internal(int fd, int events) {
+    return picoev.fds[fd].events != (events & PICOEV_READWRITE);
+  }
+  
+  /* registers n file descriptors at once, fds[i] watching events[i] and
+     calling callbacks[i] with cb_args[i] (cb_args may be NULL). The changes
+     are submitted to the kernel in a batch where the backend can. Returns
+     -1 if any of them failed, the failed ones being left unregistered */
+  PICOEV_INLINE
+  int picoev_add_many(picoev_loop* loop, const int* fds, const int* events,
+		      int timeout_in_secs, picoev_handler* const* callbacks,
+		      void* const* cb_args, int n) {
+    picoev_fd* target;
+    int i, r;
+    for (i = 0; i < n; ++i) {
+      assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fds[i]));
+      target = picoev.fds + fds[i];
+      assert(target->loop_id == 0);
+      target->callback = callbacks[i];
+      target->cb_arg = cb_args != NULL ? cb_args[i] : NULL;
+      target->loop_id = loop->loop_id;
+      target->events = 0;
+      PICOEV_FD_COLD(fds[i])->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
+    }
+    r = picoev_update_events_many_internal(loop, fds, events, PICOEV_ADD, n);
+    for (i = 0; i < n; ++i) {
+      if (r != 0 && picoev_update_failed_internal(fds[i], events[i])) {
+	picoev.fds[fds[i]].loop_id = 0;
+	continue;
+      }
+      picoev_set_active_internal(loop, fds[i]);
+      picoev_set_timeout(loop, fds[i], timeout_in_secs);
+    }
+    return r;
+  }
+  
+  /* unregisters n file descriptors at once. Returns -1 if any of them
+     failed, the failed ones being left registered */
+  PICOEV_INLINE
+  int picoev_del_many(picoev_loop* loop, const int* fds, int n) {
+    int i, r;
+    for (i = 0; i < n; ++i) {
+      assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fds[i]));
+    }
+    r = picoev_update_events_many_internal(loop, fds, NULL, PICOEV_DEL, n);
+    for (i = 0; i < n; ++i) {
+      if (r != 0 && picoev_update_failed_internal(fds[i], 0)) {
+	continue;
+      }
+      picoev_rate_forget_internal(loop, fds[i]);
+      picoev_set_timeout(loop, fds[i], 0);
+      picoev_clear_active_internal(loop, fds[i]);
+      picoev.fds[fds[i]].loop_id = 0;
+    }
+    return r;
+  }
+  
   /* check if fd is registered (checks all loops if loop == NULL) */
   PICOEV_INLINE
   int picoev_is_active(picoev_loop* loop, int fd) {
@@ -258,15 +1081,25 @@ extern "C" {
   
   /* returns events being watched for given descriptor */
   PICOEV_INLINE
-  int picoev_get_events(picoev_loop* loop __attribute__((unused)), int fd) {
+  int picoev_get_events(picoev_loop* loop, int fd) {
+    picoev_rate_limit* limit;
     assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fd));
+    if (loop != NULL
+	&& (limit = picoev_rate_limit_of_internal(loop, fd)) != NULL) {
+      return limit->events;
+    }
     return picoev.fds[fd].events & PICOEV_READWRITE;
   }
   
-  /* sets events to be watched for given desriptor */
+  /* sets events to be watched for given desriptor (less those throttled by
+     picoev_set_rate_limit until their bucket refills) */
   PICOEV_INLINE
   int picoev_set_events(picoev_loop* loop, int fd, int events) {
-    assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fd));
+    picoev_rate_limit* limit = picoev_rate_limit_of_internal(loop, fd);
+    if (limit != NULL) {
+      limit->events = events & PICOEV_READWRITE;
+      events = limit->events & ~limit->throttled;
+    }
     if (picoev.fds[fd].events != events
 	&& picoev_update_events_internal(loop, fd, events) != 0) {
       return -1;
@@ -274,6 +1107,27 @@ extern "C" {
     return 0;
   }
   
+  /* sets events to be watched for n descriptors at once, fds[i] watching
+     events[i]. The changes are submitted in a batch where the backend can */
+  PICOEV_INLINE
+  int picoev_set_events_many(picoev_loop* loop, const int* fds,
+			     const int* events, int n) {
+    int i, r = 0;
+    for (i = 0; i < n; ++i) {
+      assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fds[i]));
+    }
+    if (loop->rate.limits != NULL) {
+      /* the rate-limited ones need filtering, one by one */
+      for (i = 0; i < n; ++i) {
+	if (picoev_set_events(loop, fds[i], events[i]) != 0) {
+	  r = -1;
+	}
+      }
+      return r;
+    }
+    return picoev_update_events_many_internal(loop, fds, events, 0, n);
+  }
+  
   /* returns callback for given descriptor */
   PICOEV_INLINE
   picoev_handler* picoev_get_callback(picoev_loop* loop __attribute__((unused)),
@@ -296,19 +1150,155 @@ extern "C" {
     picoev.fds[fd].callback = callback;
   }
   
+  /* copies the runtime statistics of the loop (all zero if the library was
+     built with PICOEV_STATS=0) */
+  PICOEV_INLINE
+  void picoev_loop_stats(picoev_loop* loop, picoev_stats* out) {
+    *out = loop->stats;
+  }
+  
+  /* starts recording the durations and the scheduling delays of the
+     callbacks to the histograms in picoev_stats, and calls hook (if not
+     NULL) for every callback that took threshold_nsec or longer. Has no
+     effect if the library was built with PICOEV_STATS=0 */
+  PICOEV_INLINE
+  void picoev_profile_callbacks(picoev_loop* loop,
+				unsigned long long threshold_nsec,
+				picoev_slow_callback_handler* hook,
+				void* hook_arg) {
+    loop->profile.enabled = 1;
+    loop->profile.threshold_nsec = threshold_nsec;
+    loop->profile.hook = hook;
+    loop->profile.hook_arg = hook_arg;
+  }
+  
+  /* stops the recording started by picoev_profile_callbacks, keeping the
+     histograms recorded so far */
+  PICOEV_INLINE
+  void picoev_profile_disable(picoev_loop* loop) {
+    loop->profile.enabled = 0;
+    loop->profile.hook = NULL;
+    loop->profile.hook_arg = NULL;
+  }
+  
+  /* returns the upper bound (in nsec) of the bucket containing the given
+     percentile (0 to 100) of a histogram in picoev_stats, or 0 if empty */
+  PICOEV_INLINE
+  unsigned long long picoev_stats_percentile(const unsigned long long* hist,
+					     double percentile) {
+    unsigned long long total = 0, rank, seen = 0;
+    int i;
+    for (i = 0; i < PICOEV_STATS_HIST_SIZE; ++i) {
+      total += hist[i];
+    }
+    if (total == 0) {
+      return 0;
+    }
+    rank = (unsigned long long)(total * percentile / 100);
+    if (rank >= total) {
+      rank = total - 1;
+    }
+    for (i = 0; i < PICOEV_STATS_HIST_SIZE - 1; ++i) {
+      if ((seen += hist[i]) > rank) {
+	break;
+      }
+    }
+    return (2ULL << i) - 1;
+  }
+  
   /* function to iterate registered information. To start iteration, set curfd
-     to -1 and call the function until -1 is returned */
+     to -1 and call the function until -1 is returned. Takes time
+     proportional to the number of fds registered to the loop */
   PICOEV_INLINE
   int picoev_next_fd(picoev_loop* loop, int curfd) {
+    size_t i, j;
+    unsigned long w, vv;
     if (curfd != -1) {
       assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(curfd));
     }
-    while (++curfd < picoev.max_fd) {
-      if (loop->loop_id == picoev.fds[curfd].loop_id) {
-	return curfd;
+    if ((size_t)++curfd >= picoev.active_vec_size * PICOEV_LONG_BITS) {
+      return -1;
+    }
+    /* rest of the current word */
+    i = curfd / PICOEV_LONG_BITS;
+    w = loop->active.vec[i] & (~0UL << (curfd % PICOEV_LONG_BITS));
+    /* skip empty words using the summary */
+    while (w == 0) {
+      if (++i >= picoev.active_vec_size) {
+	return -1;
+      }
+      j = i / PICOEV_LONG_BITS;
+      vv = loop->active.vec_of_vec[j] & (~0UL << (i % PICOEV_LONG_BITS));
+      while (vv == 0) {
+	if (++j >= picoev.active_vec_of_vec_size) {
+	  return -1;
+	}
+	vv = loop->active.vec_of_vec[j];
+      }
+      i = j * PICOEV_LONG_BITS + PICOEV_CTZL(vv);
+      w = loop->active.vec[i];
+    }
+    return (int)(i * PICOEV_LONG_BITS + PICOEV_CTZL(w));
+  }
+  
+  /* returns the number of fds registered to the loop */
+  PICOEV_INLINE
+  int picoev_loop_active_count(picoev_loop* loop) {
+    return loop->active.count;
+  }
+  
+  /* internal: moves the arena to the next chunk that fits size, allocating
+     one if none */
+  PICOEV_INLINE
+  void* picoev_scratch_alloc_slow_internal(picoev_loop* loop, size_t size) {
+    picoev_scratch_chunk** link = loop->scratch.cur != NULL
+      ? &loop->scratch.cur->next : &loop->scratch.chunks;
+    picoev_scratch_chunk* chunk = *link;
+    if (chunk == NULL || chunk->size - PICOEV_SCRATCH_HDR_SIZE < size) {
+      size_t chunk_size = PICOEV_SCRATCH_HDR_SIZE + size;
+      if (chunk_size < PICOEV_SCRATCH_CHUNK_SIZE) {
+	chunk_size = PICOEV_SCRATCH_CHUNK_SIZE;
       }
+      if ((chunk = (picoev_scratch_chunk*)picoev_alloc_internal(
+	     chunk_size, PICOEV_ALLOC_SCRATCH))
+	  == NULL) {
+	return NULL;
+      }
+      chunk->next = *link;
+      chunk->size = chunk_size;
+      *link = chunk;
+    }
+    loop->scratch.cur = chunk;
+    loop->scratch.ptr = (char*)chunk + PICOEV_SCRATCH_HDR_SIZE + size;
+    loop->scratch.end = (char*)chunk + chunk->size;
+    return (char*)chunk + PICOEV_SCRATCH_HDR_SIZE;
+  }
+  
+  /* allocates size bytes (aligned to PICOEV_SCRATCH_ALIGN) that are valid
+     until the current iteration of picoev_loop_once returns, for the
+     short-lived buffers of the handlers. The chunks are reused by the
+     following iterations so that the steady state never allocates. Returns
+     NULL if failed */
+  PICOEV_INLINE
+  void* picoev_scratch_alloc(picoev_loop* loop, size_t size) {
+    char* p = loop->scratch.ptr;
+    size = PICOEV_RND_UP(size, PICOEV_SCRATCH_ALIGN);
+    if ((size_t)(loop->scratch.end - p) < size) {
+      return picoev_scratch_alloc_slow_internal(loop, size);
+    }
+    loop->scratch.ptr = p + size;
+    return p;
+  }
+  
+  /* internal: releases everything allocated from the arena */
+  PICOEV_INLINE
+  void picoev_scratch_reset_internal(picoev_loop* loop) {
+    picoev_scratch_chunk* chunk = loop->scratch.chunks;
+    if (chunk != NULL) {
+      loop->scratch.cur = chunk;
+      loop->scratch.ptr = (char*)chunk + PICOEV_SCRATCH_HDR_SIZE;
+      loop->scratch.end = (char*)chunk + chunk->size;
     }
-    return -1;
   }
   
   /* internal function */
@@ -317,14 +1307,26 @@ extern "C" {
     loop->loop_id = ++picoev.num_loops;
     assert(PICOEV_TOO_MANY_LOOPS);
     if ((loop->timeout.vec_of_vec
-	 = (short*)picoev_memalign((picoev.timeout_vec_of_vec_size
-				    + picoev.timeout_vec_size)
-				   * sizeof(short) * PICOEV_TIMEOUT_VEC_SIZE,
-				   &loop->timeout._free_addr, 1))
+	 = (short*)picoev_alloc_table_internal(PICOEV_TIMEOUT_TABLE_SIZE,
+					       PICOEV_ALLOC_TIMEOUT,
+					       &loop->timeout._free_addr))
 	== NULL) {
       --picoev.num_loops;
       return -1;
     }
+    if ((loop->active.vec_of_vec
+	 = (unsigned long*)picoev_alloc_table_internal(
+	     PICOEV_ACTIVE_TABLE_SIZE, PICOEV_ALLOC_ACTIVE,
+	     &loop->active._free_addr))
+	== NULL) {
+      picoev_free_table_internal(loop->timeout._free_addr,
+				 PICOEV_TIMEOUT_TABLE_SIZE,
+				 PICOEV_ALLOC_TIMEOUT);
+      --picoev.num_loops;
+      return -1;
+    }
+    loop->active.vec = loop->active.vec_of_vec + picoev.active_vec_of_vec_size;
+    loop->active.count = 0;
     loop->timeout.vec = loop->timeout.vec_of_vec
       + picoev.timeout_vec_of_vec_size * PICOEV_TIMEOUT_VEC_SIZE;
     loop->timeout.base_idx = 0;
@@ -332,19 +1334,133 @@ extern "C" {
     loop->timeout.resolution
       = PICOEV_RND_UP(max_timeout, PICOEV_TIMEOUT_VEC_SIZE)
       / PICOEV_TIMEOUT_VEC_SIZE;
+    memset(loop->timeout.num_armed, 0, sizeof(loop->timeout.num_armed));
+    memset(&loop->stats, 0, sizeof(loop->stats));
+    memset(&loop->scratch, 0, sizeof(loop->scratch));
+    memset(&loop->read, 0, sizeof(loop->read));
+    memset(&loop->rate, 0, sizeof(loop->rate));
+    memset(&loop->profile, 0, sizeof(loop->profile));
+    loop->backend = NULL;
     return 0;
   }
   
   /* internal function */
   PICOEV_INLINE
   void picoev_deinit_loop_internal(picoev_loop* loop) {
-    free(loop->timeout._free_addr);
+    picoev_free_table_internal(loop->timeout._free_addr,
+			       PICOEV_TIMEOUT_TABLE_SIZE, PICOEV_ALLOC_TIMEOUT);
+    picoev_free_table_internal(loop->active._free_addr,
+			       PICOEV_ACTIVE_TABLE_SIZE, PICOEV_ALLOC_ACTIVE);
+    while (loop->scratch.chunks != NULL) {
+      picoev_scratch_chunk* chunk = loop->scratch.chunks;
+      loop->scratch.chunks = chunk->next;
+      picoev_free_internal(chunk, chunk->size, PICOEV_ALLOC_SCRATCH);
+    }
+    if (loop->read.handlers != NULL) {
+      picoev_free_table_internal(loop->read._free_addr,
+				 sizeof(picoev_data_handler*) * picoev.max_fd,
+				 PICOEV_ALLOC_READ);
+    }
+    while (loop->read.free_bufs != NULL) {
+      void* buf = loop->read.free_bufs;
+      loop->read.free_bufs = *(void**)buf;
+      picoev_free_internal(buf, PICOEV_READ_BUF_SIZE, PICOEV_ALLOC_READ);
+    }
+    if (loop->rate.limits != NULL) {
+      picoev_free_table_internal(loop->rate._free_addr,
+				 sizeof(picoev_rate_limit) * picoev.max_fd,
+				 PICOEV_ALLOC_RATE);
+    }
+  }
+  
+  /* internal: returns a monotonic timestamp used by the stats */
+  PICOEV_INLINE
+  unsigned long long picoev_stats_clock_internal(void) {
+#if PICOEV_STATS && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    return 0;
+#endif
+  }
+  
+  /* internal: called by backends once the poll (started at poll_start)
+     returns, before dispatching; updates the clock as the poll may have
+     blocked for long, and accounts the poll */
+  PICOEV_INLINE
+  void picoev_polled_internal(picoev_loop* loop, int nevents,
+			      unsigned long long poll_start) {
+    loop->now = time(NULL);
+#if PICOEV_STATS
+    loop->profile.polled_at = picoev_stats_clock_internal();
+    loop->stats.blocked_nsec += loop->profile.polled_at - poll_start;
+    if (nevents == 0) {
+      ++loop->stats.empty_polls;
+    } else if ((unsigned)nevents > loop->stats.max_events_per_poll) {
+      loop->stats.max_events_per_poll = nevents;
+    }
+#endif
+  }
+  
+  /* internal: returns the histogram bucket of given duration */
+  PICOEV_INLINE
+  int picoev_stats_hist_bucket_internal(unsigned long long nsec) {
+    int bucket = 0;
+#ifdef __GNUC__
+    if (nsec != 0) {
+      bucket = 63 - __builtin_clzll(nsec);
+    }
+#else
+    while ((nsec >>= 1) != 0) {
+      ++bucket;
+    }
+#endif
+    return bucket < PICOEV_STATS_HIST_SIZE
+      ? bucket : PICOEV_STATS_HIST_SIZE - 1;
+  }
+  
+  /* internal: calls the handler of given fd (called by backends) */
+  PICOEV_INLINE
+  void picoev_call_internal(picoev_loop* loop, int fd, picoev_fd* target,
+			    int revents) {
+    picoev_rate_limit* limit = picoev_rate_limit_of_internal(loop, fd);
+    if (limit != NULL
+	&& (revents = picoev_rate_dispatch_internal(loop, fd, limit, revents))
+	== 0) {
+      return;
+    }
+    PICOEV_PROBE2(dispatch, fd, revents);
+#if PICOEV_STATS
+    if (loop->profile.enabled) {
+      /* the handler may replace itself, remember which one was called */
+      picoev_handler* callback = target->callback;
+      unsigned long long start = picoev_stats_clock_internal(), elapsed;
+      if ((revents & PICOEV_TIMEOUT) == 0) {
+	++loop->stats.dispatch_lag_hist[picoev_stats_hist_bucket_internal(
+	    start - loop->profile.polled_at)];
+      }
+      (*callback)(loop, fd, revents, target->cb_arg);
+      elapsed = picoev_stats_clock_internal() - start;
+      ++loop->stats.callback_hist[picoev_stats_hist_bucket_internal(elapsed)];
+      if (elapsed >= loop->profile.threshold_nsec
+	  && loop->profile.hook != NULL) {
+	(*loop->profile.hook)(loop, fd, callback, elapsed,
+			      loop->profile.hook_arg);
+      }
+      return;
+    }
+#endif
+    (*target->callback)(loop, fd, revents, target->cb_arg);
   }
   
   /* internal function */
   PICOEV_INLINE
   void picoev_handle_timeout_internal(picoev_loop* loop) {
     size_t i, j, k;
+#if PICOEV_STATS
+    int lag_bucket = 0;
+#endif
     for (;
 	 loop->timeout.base_time <= loop->now - loop->timeout.resolution; 
 	 loop->timeout.base_idx
@@ -354,6 +1470,20 @@ extern "C" {
       short* vec = PICOEV_TIMEOUT_VEC_OF(loop, loop->timeout.base_idx);
       short* vec_of_vec
 	= PICOEV_TIMEOUT_VEC_OF_VEC_OF(loop, loop->timeout.base_idx);
+      if (loop->timeout.num_armed[loop->timeout.base_idx] == 0) {
+	continue;
+      }
+#if PICOEV_STATS && defined(CLOCK_REALTIME)
+      if (loop->profile.enabled) {
+	/* the slot expired at base_time + resolution (in wall clock) */
+	struct timespec ts;
+	long long lag;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	lag = ((long long)ts.tv_sec - loop->timeout.base_time
+	       - loop->timeout.resolution) * 1000000000 + ts.tv_nsec;
+	lag_bucket = picoev_stats_hist_bucket_internal(lag > 0 ? lag : 0);
+      }
+#endif
       for (i = 0; i < picoev.timeout_vec_of_vec_size; ++i) {
 	short vv = vec_of_vec[i];
 	if (vv != 0) {
@@ -364,9 +1494,23 @@ extern "C" {
 	      for (k = j * PICOEV_SHORT_BITS; v != 0; k++, v <<= 1) {
 		if (v < 0) {
 		  picoev_fd* fd = picoev.fds + k;
+		  picoev_fd_cold* cold = PICOEV_FD_COLD(k);
 		  assert(fd->loop_id == loop->loop_id);
-		  fd->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
-		  (*fd->callback)(loop, k, PICOEV_TIMEOUT, fd->cb_arg);
+		  cold->timeout_idx = PICOEV_TIMEOUT_IDX_UNUSED;
+		  if (cold->timeout_at > loop->now) {
+		    /* refreshed by picoev_refresh_timeout, re-arm */
+		    picoev_set_timeout_internal(loop, k,
+						cold->timeout_at - loop->now);
+		  } else {
+		    PICOEV_PROBE1(timeout, k);
+		    PICOEV_STATS_ADD(loop, timeouts, 1);
+#if PICOEV_STATS
+		    if (loop->profile.enabled) {
+		      ++loop->stats.timeout_lag_hist[lag_bucket];
+		    }
+#endif
+		    picoev_call_internal(loop, k, fd, PICOEV_TIMEOUT);
+		  }
 		}
 	      }
 	      vec[j] = 0;
@@ -375,23 +1519,46 @@ extern "C" {
 	  vec_of_vec[i] = 0;
 	}
       }
+      loop->timeout.num_armed[loop->timeout.base_idx] = 0;
     }
   }
   
+  /* internal: returns the number of seconds until the earliest armed slot
+     expires, or max_wait if it expires later (or nothing is armed) */
+  PICOEV_INLINE
+  int picoev_next_timeout_internal(picoev_loop* loop, int max_wait) {
+    size_t delta;
+    time_t wait;
+    for (delta = 0; delta < PICOEV_TIMEOUT_VEC_SIZE; ++delta) {
+      if (loop->timeout.num_armed[(loop->timeout.base_idx + delta)
+				  % PICOEV_TIMEOUT_VEC_SIZE]
+	  != 0) {
+	/* slot base_idx + delta is handled once base_time + delta *
+	   resolution <= now - resolution */
+	wait = loop->timeout.base_time
+	  + (time_t)(delta + 1) * loop->timeout.resolution - loop->now;
+	if (wait < max_wait) {
+	  max_wait = wait < 0 ? 0 : (int)wait;
+	}
+	break;
+      }
+    }
+    return max_wait;
+  }
+  
   /* loop once */
   PICOEV_INLINE
   int picoev_loop_once(picoev_loop* loop, int max_wait) {
+    PICOEV_STATS_ADD(loop, iterations, 1);
     loop->now = time(NULL);
-    if (max_wait > loop->timeout.resolution) {
-      max_wait = loop->timeout.resolution;
-    }
+    /* sleep until the earliest timeout is due instead of waking up every
+       resolution period */
+    max_wait = picoev_next_timeout_internal(loop, max_wait);
     if (picoev_poll_once_internal(loop, max_wait) != 0) {
       return -1;
     }
-    if (max_wait != 0) {
-      loop->now = time(NULL);
-    }
     picoev_handle_timeout_internal(loop);
+    picoev_scratch_reset_internal(loop);
     return 0;
   }
   
@@ -401,4 +1568,38 @@ extern "C" {
 }
 #endif
 
+/* single-header mode: define PICOEV_IMPLEMENTATION in exactly one
+   translation unit to compile the backend (and the helpers) into it
+   instead of linking libpicoev, so that the calls from the inline functions
+   above into the backend can be inlined as well. The backend is detected
+   from the platform unless PICOEV_USE_{EPOLL,KQUEUE,SELECT} is defined */
+#ifdef PICOEV_IMPLEMENTATION
+# ifdef PICOEV_MULTI_BACKEND
+#  error "PICOEV_IMPLEMENTATION supports a single backend"
+# endif
+# if ! defined(PICOEV_USE_EPOLL) && ! defined(PICOEV_USE_KQUEUE) \
+  && ! defined(PICOEV_USE_SELECT)
+#  if defined(__linux__)
+#   define PICOEV_USE_EPOLL
+#  elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) \
+  || defined(__NetBSD__) || defined(__DragonFly__)
+#   define PICOEV_USE_KQUEUE
+#  else
+#   define PICOEV_USE_SELECT
+#  endif
+# endif
+# if defined(PICOEV_USE_EPOLL)
+#  include "picoev_epoll.c"
+# elif defined(PICOEV_USE_KQUEUE)
+#  include "picoev_kqueue.c"
+# else
+#  include "picoev_select.c"
+# endif
+# include "picoev_alloc.c"
+# include "picoev_child.c"
+# include "picoev_read.c"
+# include "picoev_listener.c"
+# include "picoev_handoff.c"
+#endif
+
 #endif
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef picoev_hpp
+#define picoev_hpp
+
+#include <unistd.h>
+#include <utility>
+#include "picoev.h"
+
+/*
+ * C++ wrapper (requires C++11). Handlers are classes deriving from
+ * picoevpp::handler<Derived> and defining on_event(int revents); the callback
+ * registered to picoev is a static trampoline that calls it directly, so
+ * that it can be inlined and no virtual call is added on top of the C API.
+ *
+ *   class conn : public picoevpp::handler<conn> {
+ *   public:
+ *     explicit conn(int fd) : picoevpp::handler<conn>(fd) {}
+ *     void on_event(int revents) { ... }
+ *   };
+ */
+
+namespace picoevpp {
+  
+  /* owns an event loop */
+  class loop {
+    picoev_loop* loop_;
+  public:
+    explicit loop(int max_timeout)
+      : loop_(picoev_create_loop(max_timeout)) {}
+    ~loop() {
+      if (loop_ != NULL) {
+	picoev_destroy_loop(loop_);
+      }
+    }
+    loop(loop&& x) : loop_(x.loop_) { x.loop_ = NULL; }
+    loop& operator=(loop&& x) {
+      std::swap(loop_, x.loop_);
+      return *this;
+    }
+    loop(const loop&) = delete;
+    loop& operator=(const loop&) = delete;
+    
+    bool is_valid() const { return loop_ != NULL; }
+    picoev_loop* get() const { return loop_; }
+    int loop_once(int max_wait) { return picoev_loop_once(loop_, max_wait); }
+    void* scratch_alloc(size_t size) {
+      return picoev_scratch_alloc(loop_, size);
+    }
+    /* runs the loop while pred() returns true */
+    template <typename Pred> int run_while(Pred pred, int max_wait = 1) {
+      while (pred()) {
+	if (picoev_loop_once(loop_, max_wait) != 0) {
+	  return -1;
+	}
+      }
+      return 0;
+    }
+  };
+  
+  /* owns a file descriptor (move-only) */
+  class file_descriptor {
+    int fd_;
+  public:
+    explicit file_descriptor(int fd = -1) : fd_(fd) {}
+    ~file_descriptor() { reset(); }
+    file_descriptor(file_descriptor&& x) : fd_(x.release()) {}
+    file_descriptor& operator=(file_descriptor&& x) {
+      reset(x.release());
+      return *this;
+    }
+    file_descriptor(const file_descriptor&) = delete;
+    file_descriptor& operator=(const file_descriptor&) = delete;
+    
+    int get() const { return fd_; }
+    int release() {
+      int fd = fd_;
+      fd_ = -1;
+      return fd;
+    }
+    void reset(int fd = -1) {
+      if (fd_ != -1) {
+	::close(fd_);
+      }
+      fd_ = fd;
+    }
+  };
+  
+  /* CRTP base of handlers; the fd is unregistered (by picoev_del) and
+     closed on destruction */
+  template <typename Derived> class handler {
+    file_descriptor fd_;
+    picoev_loop* loop_; /* NULL if not registered */
+    
+    static void callback_(picoev_loop*, int, int revents, void* cb_arg) {
+      static_cast<Derived*>(cb_arg)->on_event(revents);
+    }
+    
+  protected:
+    explicit handler(int fd) : fd_(fd), loop_(NULL) {}
+    explicit handler(file_descriptor&& fd) : fd_(std::move(fd)), loop_(NULL) {}
+    ~handler() { del(); }
+    handler(handler&& x) : fd_(std::move(x.fd_)), loop_(x.loop_) {
+      x.loop_ = NULL;
+      if (loop_ != NULL) {
+	/* the callback argument points to the moved-from object */
+	void* cb_arg = static_cast<Derived*>(this);
+	picoev_set_callback(loop_, fd_.get(), callback_, &cb_arg);
+      }
+    }
+    handler(const handler&) = delete;
+    handler& operator=(const handler&) = delete;
+    
+  public:
+    int fd() const { return fd_.get(); }
+    picoev_loop* get_loop() const { return loop_; }
+    bool is_active() const { return loop_ != NULL; }
+    
+    int add(loop& l, int events, int timeout_in_secs = 0) {
+      return add(l.get(), events, timeout_in_secs);
+    }
+    int add(picoev_loop* l, int events, int timeout_in_secs = 0) {
+      if (picoev_add(l, fd_.get(), events, timeout_in_secs, callback_,
+		     static_cast<Derived*>(this))
+	  != 0) {
+	return -1;
+      }
+      loop_ = l;
+      return 0;
+    }
+    int del() {
+      if (loop_ == NULL) {
+	return 0;
+      }
+      if (picoev_del(loop_, fd_.get()) != 0) {
+	return -1;
+      }
+      loop_ = NULL;
+      return 0;
+    }
+    int get_events() const { return picoev_get_events(loop_, fd_.get()); }
+    int set_events(int events) {
+      return picoev_set_events(loop_, fd_.get(), events);
+    }
+    void set_timeout(int secs) { picoev_set_timeout(loop_, fd_.get(), secs); }
+    void refresh_timeout(int secs) {
+      picoev_refresh_timeout(loop_, fd_.get(), secs);
+    }
+    int set_rate_limit(int events, unsigned rate, unsigned burst = 0,
+		       int unit = PICOEV_RATE_BYTES) {
+      return picoev_set_rate_limit(loop_, fd_.get(), events, rate, burst,
+				   unit);
+    }
+    int rate_consume(int events, size_t n) {
+      return picoev_rate_consume(loop_, fd_.get(), events, n);
+    }
+    /* closes the fd after unregistering it */
+    void close() {
+      del();
+      fd_.reset();
+    }
+    /* unregisters the fd and gives up its ownership */
+    int release() {
+      del();
+      return fd_.release();
+    }
+  };
+  
+}
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+#include "picoev.h"
+
+#ifdef _WIN32
+
+void* picoev_default_alloc(size_t sz, int kind __attribute__((unused)),
+			   void* arg __attribute__((unused)))
+{
+  return calloc(1, sz);
+}
+
+void picoev_default_free(void* p, size_t sz __attribute__((unused)),
+			 int kind __attribute__((unused)),
+			 void* arg __attribute__((unused)))
+{
+  free(p);
+}
+
+#else
+
+/* only the tables large enough for huge pages are mapped, the rest (small
+   per-loop tables, scratch chunks, read buffers) comes from calloc */
+#define PICOEV_USE_MMAP(sz) ((sz) >= PICOEV_HUGE_PAGE_SIZE)
+#define PICOEV_MAPPED_SIZE(sz) PICOEV_RND_UP(sz, PICOEV_HUGE_PAGE_SIZE)
+
+#ifndef MAP_ANONYMOUS
+# define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* maps len bytes aligned to a huge page, so that transparent huge pages can
+   back the whole range */
+static void* picoev_map_aligned(size_t len)
+{
+  char* p, * aligned;
+  
+  if ((p = (char*)mmap(NULL, len + PICOEV_HUGE_PAGE_SIZE,
+		       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		       -1, 0))
+      == MAP_FAILED) {
+    return NULL;
+  }
+  aligned = (char*)PICOEV_RND_UP((unsigned long)p, PICOEV_HUGE_PAGE_SIZE);
+  if (aligned != p) {
+    munmap(p, aligned - p);
+  }
+  munmap(aligned + len, p + PICOEV_HUGE_PAGE_SIZE - aligned);
+  return aligned;
+}
+
+void* picoev_default_alloc(size_t sz, int kind __attribute__((unused)),
+			   void* arg __attribute__((unused)))
+{
+  size_t len;
+  void* p = NULL;
+  
+  if (! PICOEV_USE_MMAP(sz)) {
+    return calloc(1, sz);
+  }
+  len = PICOEV_MAPPED_SIZE(sz);
+#ifdef MAP_HUGETLB
+  /* only succeeds if huge pages have been reserved */
+  if ((p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0))
+      == MAP_FAILED) {
+    p = NULL;
+  }
+#endif
+  if (p == NULL && (p = picoev_map_aligned(len)) != NULL) {
+#ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#endif
+  }
+  /* pages are not touched until used, so that they are placed on the node
+     of the thread using them first */
+  return p;
+}
+
+void picoev_default_free(void* p, size_t sz, int kind __attribute__((unused)),
+			 void* arg __attribute__((unused)))
+{
+  if (PICOEV_USE_MMAP(sz)) {
+    munmap(p, PICOEV_MAPPED_SIZE(sz));
+  } else {
+    free(p);
+  }
+}
+
+#endif
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Dispatcher for builds with several backends. Compile this file and every
+ * backend listed below with PICOEV_MULTI_BACKEND defined (make
+ * MULTI_BUILD=1); each loop then records the backend that created it, and
+ * the entry points called by picoev.h are forwarded to it.
+ */
+
+#ifndef PICOEV_MULTI_BACKEND
+# error "picoev_backend.c requires PICOEV_MULTI_BACKEND"
+#endif
+
+#include <string.h>
+#include "picoev.h"
+
+picoev_globals picoev;
+
+#if defined(__linux__)
+extern const picoev_backend picoev_epoll_backend;
+#endif
+#if defined(__APPLE__)
+extern const picoev_backend picoev_kqueue_backend;
+#endif
+extern const picoev_backend picoev_select_backend;
+
+/* in the order of preference */
+static const picoev_backend* const backends[] = {
+#if defined(__linux__)
+  &picoev_epoll_backend,
+#endif
+#if defined(__APPLE__)
+  &picoev_kqueue_backend,
+#endif
+  &picoev_select_backend,
+  NULL
+};
+
+const picoev_backend* picoev_find_backend(const char* name)
+{
+  const picoev_backend* const* b;
+  
+  for (b = backends; *b != NULL; ++b) {
+    if (strcmp((*b)->name, name) == 0) {
+      return *b;
+    }
+  }
+  return NULL;
+}
+
+picoev_loop* picoev_create_loop_with_backend(const picoev_backend* backend,
+					     int max_timeout)
+{
+  picoev_loop* loop;
+  
+  if ((loop = backend->create_loop(max_timeout)) == NULL) {
+    return NULL;
+  }
+  loop->backend = backend;
+  return loop;
+}
+
+/* falls back to the next backend if one cannot create a loop (e.g. when
+   the system call is blocked by seccomp) */
+picoev_loop* picoev_create_loop(int max_timeout)
+{
+  const picoev_backend* const* b;
+  picoev_loop* loop;
+  
+  for (b = backends; *b != NULL; ++b) {
+    if ((loop = picoev_create_loop_with_backend(*b, max_timeout)) != NULL) {
+      return loop;
+    }
+  }
+  return NULL;
+}
+
+int picoev_destroy_loop(picoev_loop* loop)
+{
+  return loop->backend->destroy_loop(loop);
+}
+
+int picoev_signal_add(picoev_loop* loop, int signo,
+		      picoev_signal_handler* callback, void* cb_arg)
+{
+  return loop->backend->signal_add(loop, signo, callback, cb_arg);
+}
+
+int picoev_signal_del(picoev_loop* loop, int signo)
+{
+  return loop->backend->signal_del(loop, signo);
+}
+
+int picoev_update_events_internal(picoev_loop* loop, int fd, int events)
+{
+  return loop->backend->update_events(loop, fd, events);
+}
+
+int picoev_update_events_many_internal(picoev_loop* loop, const int* fds,
+				       const int* events, int flags, int n)
+{
+  return loop->backend->update_events_many(loop, fds, events, flags, n);
+}
+
+int picoev_poll_once_internal(picoev_loop* loop, int max_wait)
+{
+  return loop->backend->poll_once(loop, max_wait);
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+#include "picoev.h"
+
+typedef struct picoev_child_st {
+  pid_t pid;
+  picoev_child_handler* callback;
+  void* cb_arg;
+  struct picoev_child_st* next; /* used by the SIGCHLD reaper */
+} picoev_child;
+
+/* children watched by the SIGCHLD reaper; the reaper is process-wide and
+   thus may only be used by a single loop */
+static picoev_child* picoev_child_reaper_children;
+static picoev_loop* picoev_child_reaper_loop;
+
+static int picoev_open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* waitpid without blocking, returning 0 if the child is still running. If
+   it cannot be waited for (e.g. ECHILD, reaped elsewhere), sets status to -1
+   and returns -1 */
+static pid_t picoev_child_reap(pid_t pid, int* status)
+{
+  pid_t r;
+  while ((r = waitpid(pid, status, WNOHANG)) == -1 && errno == EINTR)
+    ;
+  if (r == -1) {
+    *status = -1;
+  }
+  return r;
+}
+
+static void picoev_child_pidfd_callback(picoev_loop* loop, int fd,
+					int revents __attribute__((unused)),
+					void* cb_arg)
+{
+  picoev_child child = *(picoev_child*)cb_arg;
+  int status, err;
+  
+  /* the pidfd becomes readable once the child exits */
+  if (picoev_child_reap(child.pid, &status) == 0) {
+    return;
+  }
+  err = errno;
+  picoev_del(loop, fd);
+  close(fd);
+  free(cb_arg);
+  errno = err;
+  (*child.callback)(loop, child.pid, status, child.cb_arg);
+}
+
+static void picoev_child_reaper_callback(picoev_loop* loop,
+					 int signo __attribute__((unused)),
+					 void* cb_arg __attribute__((unused)))
+{
+  picoev_child** link = &picoev_child_reaper_children, * child;
+  int status;
+  
+  while ((child = *link) != NULL) {
+    if (picoev_child_reap(child->pid, &status) != 0) {
+      *link = child->next;
+      (*child->callback)(loop, child->pid, status, child->cb_arg);
+      free(child);
+    } else {
+      link = &child->next;
+    }
+  }
+  if (picoev_child_reaper_children == NULL) {
+    picoev_signal_del(loop, SIGCHLD);
+    picoev_child_reaper_loop = NULL;
+  }
+}
+
+int picoev_child_add(picoev_loop* loop, pid_t pid,
+		     picoev_child_handler* callback, void* cb_arg)
+{
+  picoev_child* child;
+  int fd;
+  
+  if ((child = (picoev_child*)malloc(sizeof(picoev_child))) == NULL) {
+    return -1;
+  }
+  child->pid = pid;
+  child->callback = callback;
+  child->cb_arg = cb_arg;
+  child->next = NULL;
+  
+  /* use pidfd if possible */
+  if ((fd = picoev_open_pidfd(pid)) != -1) {
+    if (picoev_add(loop, fd, PICOEV_READ, 0, picoev_child_pidfd_callback,
+		   child)
+	!= 0) {
+      close(fd);
+      free(child);
+      return -1;
+    }
+    return 0;
+  } else if (errno != ENOSYS) {
+    free(child);
+    return -1;
+  }
+  
+  /* fallback to the SIGCHLD reaper */
+  assert(picoev_child_reaper_loop == NULL || picoev_child_reaper_loop == loop);
+  if (picoev_child_reaper_loop == NULL) {
+    if (picoev_signal_add(loop, SIGCHLD, picoev_child_reaper_callback, NULL)
+	!= 0) {
+      free(child);
+      return -1;
+    }
+    picoev_child_reaper_loop = loop;
+  }
+  child->next = picoev_child_reaper_children;
+  picoev_child_reaper_children = child;
+  /* the child might have exited before SIGCHLD was being watched */
+  kill(getpid(), SIGCHLD);
+  
+  return 0;
+}
+
+#endif
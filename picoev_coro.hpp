@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef picoev_coro_hpp
+#define picoev_coro_hpp
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include "picoev.hpp"
+
+/*
+ * C++20 coroutine API. A coroutine returning picoevpp::task and taking a
+ * picoevpp::coro_loop& as its first argument starts running immediately
+ * and may suspend on co_await readable(loop, fd, timeout) or writable(...),
+ * which evaluate to the revents passed to the callback (PICOEV_TIMEOUT on
+ * timeout, -1 if the fd could not be registered).
+ *
+ *   picoevpp::task echo(picoevpp::coro_loop& loop, int fd) {
+ *     char buf[4096];
+ *     ssize_t r;
+ *     while ((co_await picoevpp::readable(loop, fd, 10) & PICOEV_READ) != 0
+ *            && (r = read(fd, buf, sizeof(buf))) > 0) {
+ *       write(fd, buf, r);
+ *     }
+ *     picoevpp::detach(loop, fd);
+ *     close(fd);
+ *   }
+ *
+ * Coroutine frames are recycled through a free list owned by the loop, and
+ * the awaiters live in the frames, so awaiting does not allocate. Waiting
+ * maps directly onto picoev_set_events and picoev_refresh_timeout; the fd is
+ * registered on first wait and stays registered (with its last interest)
+ * until detach() is called, so that a coroutine waiting repeatedly for the
+ * same event issues no system calls to do so.
+ */
+
+namespace picoevpp {
+  
+  /* free lists of coroutine frames, by size class */
+  class frame_pool {
+    struct free_frame {
+      free_frame* next;
+    };
+    enum {
+      granularity = 64,
+      num_classes = 32 /* frames larger than 2KB are not recycled */
+    };
+    free_frame* free_[num_classes];
+    
+    static std::size_t class_of(std::size_t size) {
+      return (size + granularity - 1) / granularity;
+    }
+    
+  public:
+    frame_pool() {
+      for (int i = 0; i < num_classes; ++i) {
+	free_[i] = NULL;
+      }
+    }
+    ~frame_pool() {
+      for (int i = 0; i < num_classes; ++i) {
+	while (free_[i] != NULL) {
+	  free_frame* f = free_[i];
+	  free_[i] = f->next;
+	  ::operator delete(f);
+	}
+      }
+    }
+    frame_pool(const frame_pool&) = delete;
+    frame_pool& operator=(const frame_pool&) = delete;
+    
+    void* allocate(std::size_t size) {
+      std::size_t c = class_of(size);
+      if (c < num_classes && free_[c] != NULL) {
+	free_frame* f = free_[c];
+	free_[c] = f->next;
+	return f;
+      }
+      return ::operator new(c * granularity);
+    }
+    void deallocate(void* p, std::size_t size) {
+      std::size_t c = class_of(size);
+      if (c < num_classes) {
+	free_frame* f = static_cast<free_frame*>(p);
+	f->next = free_[c];
+	free_[c] = f;
+      } else {
+	::operator delete(p);
+      }
+    }
+  };
+  
+  /* event loop owning the frame pool of the coroutines running on it; all
+     of them must have finished before it is destroyed */
+  class coro_loop : public loop {
+    frame_pool pool_;
+  public:
+    explicit coro_loop(int max_timeout) : loop(max_timeout) {}
+    coro_loop(coro_loop&&) = delete;
+    coro_loop& operator=(coro_loop&&) = delete;
+    
+    frame_pool& pool() { return pool_; }
+  };
+  
+  /* fire-and-forget coroutine; the frame is freed when it returns */
+  class task {
+  public:
+    class promise_type {
+      /* each frame is prefixed by its pool, for operator delete */
+      enum { header_size = alignof(std::max_align_t) };
+    public:
+      template <typename... Args>
+      static void* operator new(std::size_t size, coro_loop& l, Args&&...) {
+	frame_pool* pool = &l.pool();
+	void* p = pool->allocate(size + header_size);
+	*static_cast<frame_pool**>(p) = pool;
+	return static_cast<char*>(p) + header_size;
+      }
+      static void operator delete(void* frame, std::size_t size) {
+	void* p = static_cast<char*>(frame) - header_size;
+	(*static_cast<frame_pool**>(p))->deallocate(p, size + header_size);
+      }
+      
+      task get_return_object() { return task(); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+    };
+  };
+  
+  /* awaiter returned by readable() and writable() */
+  class io_awaiter {
+    picoev_loop* loop_;
+    int fd_;
+    int events_;
+    int timeout_in_secs_;
+    int revents_;
+    std::coroutine_handle<> handle_;
+    
+    static void callback_(picoev_loop* loop, int fd, int revents,
+			  void* cb_arg) {
+      if (cb_arg == NULL) {
+	/* interest left over by a coroutine that stopped waiting */
+	picoev_set_events(loop, fd, 0);
+	return;
+      }
+      io_awaiter* self = static_cast<io_awaiter*>(cb_arg);
+      void* none = NULL;
+      picoev_set_callback(loop, fd, callback_, &none);
+      self->revents_ = revents;
+      self->handle_.resume();
+    }
+    
+  public:
+    io_awaiter(picoev_loop* loop, int fd, int events, int timeout_in_secs)
+      : loop_(loop), fd_(fd), events_(events),
+	timeout_in_secs_(timeout_in_secs), revents_(0) {}
+    
+    bool await_ready() const noexcept { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+      handle_ = handle;
+      if (! picoev_is_active(loop_, fd_)) {
+	if (picoev_add(loop_, fd_, events_, timeout_in_secs_, callback_, this)
+	    != 0) {
+	  revents_ = -1;
+	  return false;
+	}
+	return true;
+      }
+      void* self = this;
+      picoev_set_callback(loop_, fd_, callback_, &self);
+      if (picoev_set_events(loop_, fd_, events_) != 0) {
+	revents_ = -1;
+	return false;
+      }
+      picoev_refresh_timeout(loop_, fd_, timeout_in_secs_);
+      return true;
+    }
+    int await_resume() const noexcept { return revents_; }
+  };
+  
+  inline io_awaiter readable(picoev_loop* l, int fd, int timeout_in_secs = 0) {
+    return io_awaiter(l, fd, PICOEV_READ, timeout_in_secs);
+  }
+  inline io_awaiter readable(loop& l, int fd, int timeout_in_secs = 0) {
+    return io_awaiter(l.get(), fd, PICOEV_READ, timeout_in_secs);
+  }
+  inline io_awaiter writable(picoev_loop* l, int fd, int timeout_in_secs = 0) {
+    return io_awaiter(l, fd, PICOEV_WRITE, timeout_in_secs);
+  }
+  inline io_awaiter writable(loop& l, int fd, int timeout_in_secs = 0) {
+    return io_awaiter(l.get(), fd, PICOEV_WRITE, timeout_in_secs);
+  }
+  
+  /* unregisters an fd waited on by a coroutine (before closing it) */
+  inline int detach(picoev_loop* l, int fd) {
+    return picoev_is_active(l, fd) ? picoev_del(l, fd) : 0;
+  }
+  inline int detach(loop& l, int fd) { return detach(l.get(), fd); }
+  
+}
+
+#endif
@@ -28,21 +28,310 @@
  */
 
 #include <errno.h>
+#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
+#define PICOEV_BACKEND_NAME epoll
 #include "picoev.h"
 
 #ifndef PICOEV_EPOLL_DEFER_DELETES
 # define PICOEV_EPOLL_DEFER_DELETES 1
 #endif
 
+/* set to 1 to submit bulk updates as IORING_OP_EPOLL_CTL through an
+   io_uring of the loop, created on first use (falls back to epoll_ctl if
+   unavailable). Off by default: the gain is small next to the extra fd and
+   failure modes of the ring */
+#ifndef PICOEV_EPOLL_URING
+# define PICOEV_EPOLL_URING 0
+#endif
+#if PICOEV_EPOLL_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# ifndef IORING_FEAT_CUR_PERSONALITY /* no IORING_OP_EPOLL_CTL (< 5.6) */
+#  undef PICOEV_EPOLL_URING
+#  define PICOEV_EPOLL_URING 0
+# endif
+#endif
+
+#define PICOEV_EPOLL_URING_ENTRIES 256
+
 typedef struct picoev_loop_epoll_st {
   picoev_loop loop;
   int epfd;
   struct epoll_event events[1024];
+  struct {
+    int fd; /* signalfd, -1 if not yet created */
+    sigset_t mask;
+    struct {
+      picoev_signal_handler* callback;
+      void* cb_arg;
+    } handlers[NSIG];
+  } signal;
+#if PICOEV_EPOLL_URING
+  struct {
+    int fd; /* -1 if not yet created, -2 if unavailable */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    int num_pending;
+    /* args of the pending ops, indexed by the sqe */
+    struct epoll_event events[PICOEV_EPOLL_URING_ENTRIES];
+    struct {
+      int op;
+      char old_events; /* of the fd, restored if the op fails */
+    } ops[PICOEV_EPOLL_URING_ENTRIES];
+  } uring;
+#endif
 } picoev_loop_epoll;
 
-picoev_globals picoev;
+#ifndef PICOEV_MULTI_BACKEND
+picoev_globals picoev; /* defined by picoev_backend.c otherwise */
+#endif
+
+static void picoev_epoll_signal_callback(picoev_loop* _loop, int fd,
+					 int revents __attribute__((unused)),
+					 void* cb_arg __attribute__((unused)))
+{
+  picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
+  struct signalfd_siginfo si[16];
+  ssize_t r;
+  size_t i;
+  
+  /* drain all pending signals, usually in a single read */
+  do {
+    if ((r = read(fd, si, sizeof(si))) <= 0) {
+      break;
+    }
+    for (i = 0; i < r / sizeof(si[0]); ++i) {
+      int signo = si[i].ssi_signo;
+      if (signo < NSIG && loop->signal.handlers[signo].callback != NULL) {
+	(*loop->signal.handlers[signo].callback)(&loop->loop, signo,
+						 loop->signal.handlers[signo]
+						 .cb_arg);
+      }
+    }
+  } while (r == sizeof(si));
+}
+
+#if PICOEV_EPOLL_URING
+
+static int picoev_epoll_setup_uring(picoev_loop_epoll* loop)
+{
+  struct io_uring_params params;
+  struct io_uring_probe* probe;
+  size_t probe_size = sizeof(struct io_uring_probe)
+    + (IORING_OP_EPOLL_CTL + 1) * sizeof(struct io_uring_probe_op);
+  int fd, supported;
+  
+  memset(&params, 0, sizeof(params));
+  if ((fd = syscall(__NR_io_uring_setup, PICOEV_EPOLL_URING_ENTRIES, &params))
+      == -1) {
+    return -1;
+  }
+  /* the op is missing on older kernels */
+  if ((probe = (struct io_uring_probe*)calloc(1, probe_size)) == NULL) {
+    close(fd);
+    return -1;
+  }
+  supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+		      probe, IORING_OP_EPOLL_CTL + 1) == 0
+    && probe->last_op >= IORING_OP_EPOLL_CTL
+    && (probe->ops[IORING_OP_EPOLL_CTL].flags & IO_URING_OP_SUPPORTED) != 0;
+  free(probe);
+  if (! supported) {
+    close(fd);
+    return -1;
+  }
+  /* map the rings */
+  loop->uring.sq_ring_size = params.sq_off.array
+    + params.sq_entries * sizeof(unsigned);
+  loop->uring.cq_ring_size = params.cq_off.cqes
+    + params.cq_entries * sizeof(struct io_uring_cqe);
+  loop->uring.sq_ring = mmap(NULL, loop->uring.sq_ring_size,
+			     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     fd, IORING_OFF_SQ_RING);
+  loop->uring.cq_ring = mmap(NULL, loop->uring.cq_ring_size,
+			     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			     fd, IORING_OFF_CQ_RING);
+  loop->uring.sqes = (struct io_uring_sqe*)
+    mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+	 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	 IORING_OFF_SQES);
+  if (loop->uring.sq_ring == MAP_FAILED || loop->uring.cq_ring == MAP_FAILED
+      || loop->uring.sqes == MAP_FAILED) {
+    if (loop->uring.sq_ring != MAP_FAILED) {
+      munmap(loop->uring.sq_ring, loop->uring.sq_ring_size);
+    }
+    if (loop->uring.cq_ring != MAP_FAILED) {
+      munmap(loop->uring.cq_ring, loop->uring.cq_ring_size);
+    }
+    if (loop->uring.sqes != MAP_FAILED) {
+      munmap(loop->uring.sqes,
+	     params.sq_entries * sizeof(struct io_uring_sqe));
+    }
+    close(fd);
+    return -1;
+  }
+#define PICOEV_URING_SQ(field) \
+  ((unsigned*)((char*)loop->uring.sq_ring + params.sq_off.field))
+#define PICOEV_URING_CQ(field) \
+  ((unsigned*)((char*)loop->uring.cq_ring + params.cq_off.field))
+  loop->uring.sq_head = PICOEV_URING_SQ(head);
+  loop->uring.sq_tail = PICOEV_URING_SQ(tail);
+  loop->uring.sq_mask = PICOEV_URING_SQ(ring_mask);
+  loop->uring.sq_array = PICOEV_URING_SQ(array);
+  loop->uring.cq_head = PICOEV_URING_CQ(head);
+  loop->uring.cq_tail = PICOEV_URING_CQ(tail);
+  loop->uring.cq_mask = PICOEV_URING_CQ(ring_mask);
+  loop->uring.cqes = (struct io_uring_cqe*)PICOEV_URING_CQ(cqes);
+#undef PICOEV_URING_SQ
+#undef PICOEV_URING_CQ
+  loop->uring.num_pending = 0;
+  loop->uring.fd = fd;
+  return 0;
+}
+
+static void picoev_epoll_destroy_uring(picoev_loop_epoll* loop)
+{
+  if (loop->uring.fd < 0) {
+    return;
+  }
+  munmap(loop->uring.sq_ring, loop->uring.sq_ring_size);
+  munmap(loop->uring.cq_ring, loop->uring.cq_ring_size);
+  munmap(loop->uring.sqes,
+	 PICOEV_EPOLL_URING_ENTRIES * sizeof(struct io_uring_sqe));
+  close(loop->uring.fd);
+}
+
+static int picoev_epoll_uring_flush(picoev_loop_epoll* loop);
+
+/* queues an epoll_ctl, flushing the queue if full (returns the result of
+   the flush, 0 otherwise) */
+static int picoev_epoll_uring_push(picoev_loop_epoll* loop, int op, int fd,
+				   int events, int old_events)
+{
+  int idx = loop->uring.num_pending++;
+  unsigned tail = *loop->uring.sq_tail;
+  struct io_uring_sqe* sqe = loop->uring.sqes + idx;
+  
+  loop->uring.events[idx].events
+    = ((events & PICOEV_READ) != 0 ? EPOLLIN : 0)
+    | ((events & PICOEV_WRITE) != 0 ? EPOLLOUT : 0);
+  loop->uring.events[idx].data.fd = fd;
+  loop->uring.ops[idx].op = op;
+  loop->uring.ops[idx].old_events = old_events;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_EPOLL_CTL;
+  sqe->fd = loop->epfd;
+  sqe->off = fd;
+  sqe->len = op;
+  sqe->addr = (unsigned long)(loop->uring.events + idx);
+  sqe->user_data = idx;
+  loop->uring.sq_array[tail & *loop->uring.sq_mask] = idx;
+  __atomic_store_n(loop->uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  if (loop->uring.num_pending == PICOEV_EPOLL_URING_ENTRIES) {
+    return picoev_epoll_uring_flush(loop);
+  }
+  return 0;
+}
+
+/* runs an op of the queue by epoll_ctl, returning 0 or -errno */
+static int picoev_epoll_uring_run_sync(picoev_loop_epoll* loop, int op,
+				       struct epoll_event* ev)
+{
+  PICOEV_STATS_ADD(&loop->loop, backend_calls, 1);
+  return epoll_ctl(loop->epfd, op, ev->data.fd, ev) == 0 ? 0 : -errno;
+}
+
+/* submits the queued ops and waits for them (they are run inline by the
+   kernel, so this does not block in practice). If io_uring_enter fails
+   (other than by EINTR), the ring is given up and the ops left are run by
+   epoll_ctl. Returns -1 if any of the ops failed, restoring the events of
+   their fds (failed deletes are ignored, the fd not being watched either
+   way) */
+static int picoev_epoll_uring_flush(picoev_loop_epoll* loop)
+{
+  int res[PICOEV_EPOLL_URING_ENTRIES];
+  int i, n, r = 0;
+  
+  while ((n = loop->uring.num_pending) != 0) {
+    int broken = 0;
+    unsigned done;
+    for (;;) {
+      unsigned to_submit = *loop->uring.sq_tail
+	- __atomic_load_n(loop->uring.sq_head, __ATOMIC_ACQUIRE);
+      unsigned done = __atomic_load_n(loop->uring.cq_tail, __ATOMIC_ACQUIRE)
+	- *loop->uring.cq_head;
+      if (to_submit == 0 && done >= (unsigned)n) {
+	break;
+      }
+      PICOEV_STATS_ADD(&loop->loop, backend_calls, 1);
+      if (syscall(__NR_io_uring_enter, loop->uring.fd, to_submit, n - done,
+		  IORING_ENTER_GETEVENTS, NULL, 0)
+	  == -1
+	  && errno != EINTR) {
+	broken = 1;
+	break;
+      }
+    }
+    /* collect the results first, since the retries below reuse the sqes
+       (1 for the ops not run) */
+    for (i = 0; i < n; ++i) {
+      res[i] = 1;
+    }
+    for (done = __atomic_load_n(loop->uring.cq_tail, __ATOMIC_ACQUIRE)
+	   - *loop->uring.cq_head;
+	 done != 0; --done) {
+      unsigned head = *loop->uring.cq_head;
+      struct io_uring_cqe* cqe
+	= loop->uring.cqes + (head & *loop->uring.cq_mask);
+      res[cqe->user_data] = cqe->res;
+      __atomic_store_n(loop->uring.cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    loop->uring.num_pending = 0;
+    if (broken) {
+      picoev_epoll_destroy_uring(loop);
+      loop->uring.fd = -2;
+    }
+    /* a MOD of an fd not yet known to epoll is retried as an ADD (as in
+       picoev_update_events_internal); the retry of op i is queued at an
+       index <= i, so it never overwrites an op yet to be examined */
+    for (i = 0; i < n; ++i) {
+      struct epoll_event* ev = loop->uring.events + i;
+      int fd = ev->data.fd, op = loop->uring.ops[i].op;
+      if (res[i] == 1) {
+	res[i] = picoev_epoll_uring_run_sync(loop, op, ev);
+      }
+      if (res[i] == -ENOENT && op == EPOLL_CTL_MOD) {
+	if (loop->uring.fd >= 0) {
+	  if (picoev_epoll_uring_push(loop, EPOLL_CTL_ADD, fd,
+				      picoev.fds[fd].events,
+				      loop->uring.ops[i].old_events)
+	      != 0) {
+	    r = -1;
+	  }
+	  continue;
+	}
+	res[i] = picoev_epoll_uring_run_sync(loop, EPOLL_CTL_ADD, ev);
+      }
+      if (res[i] != 0 && op != EPOLL_CTL_DEL) {
+	picoev.fds[fd].events = loop->uring.ops[i].old_events;
+	r = -1;
+      }
+    }
+  }
+  return r;
+}
+
+#endif
 
 picoev_loop* picoev_create_loop(int max_timeout)
 {
@@ -64,6 +353,12 @@ picoev_loop* picoev_create_loop(int max_timeout)
     free(loop);
     return NULL;
   }
+  loop->signal.fd = -1;
+  sigemptyset(&loop->signal.mask);
+#if PICOEV_EPOLL_URING
+  loop->uring.fd = -1;
+#endif
+  memset(loop->signal.handlers, 0, sizeof(loop->signal.handlers));
   
   loop->loop.now = time(NULL);
   return &loop->loop;
@@ -73,6 +368,15 @@ int picoev_destroy_loop(picoev_loop* _loop)
 {
   picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
   
+  if (loop->signal.fd != -1) {
+    picoev_del(&loop->loop, loop->signal.fd);
+    close(loop->signal.fd);
+    sigprocmask(SIG_UNBLOCK, &loop->signal.mask, NULL);
+    loop->signal.fd = -1;
+  }
+#if PICOEV_EPOLL_URING
+  picoev_epoll_destroy_uring(loop);
+#endif
   if (close(loop->epfd) != 0) {
     return -1;
   }
@@ -81,6 +385,65 @@ int picoev_destroy_loop(picoev_loop* _loop)
   return 0;
 }
 
+int picoev_signal_add(picoev_loop* _loop, int signo,
+		      picoev_signal_handler* callback, void* cb_arg)
+{
+  picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
+  sigset_t mask, block;
+  int fd;
+  
+  assert(0 < signo && signo < NSIG);
+  assert(loop->signal.handlers[signo].callback == NULL);
+  
+  /* the signal needs to be blocked for signalfd to receive it */
+  sigemptyset(&block);
+  sigaddset(&block, signo);
+  mask = loop->signal.mask;
+  sigaddset(&mask, signo);
+  if ((fd = signalfd(loop->signal.fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC))
+      == -1) {
+    return -1;
+  }
+  if (loop->signal.fd == -1) {
+    if (picoev_add(&loop->loop, fd, PICOEV_READ, 0,
+		   picoev_epoll_signal_callback, NULL)
+	!= 0) {
+      close(fd);
+      return -1;
+    }
+    loop->signal.fd = fd;
+  }
+  sigprocmask(SIG_BLOCK, &block, NULL);
+  loop->signal.mask = mask;
+  loop->signal.handlers[signo].callback = callback;
+  loop->signal.handlers[signo].cb_arg = cb_arg;
+  
+  return 0;
+}
+
+int picoev_signal_del(picoev_loop* _loop, int signo)
+{
+  picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
+  sigset_t mask, block;
+  
+  assert(0 < signo && signo < NSIG);
+  assert(loop->signal.handlers[signo].callback != NULL);
+  
+  mask = loop->signal.mask;
+  sigdelset(&mask, signo);
+  if (signalfd(loop->signal.fd, &mask, 0) == -1) {
+    return -1;
+  }
+  sigemptyset(&block);
+  sigaddset(&block, signo);
+  sigprocmask(SIG_UNBLOCK, &block, NULL);
+  loop->signal.mask = mask;
+  loop->signal.handlers[signo].callback = NULL;
+  loop->signal.handlers[signo].cb_arg = NULL;
+  
+  return 0;
+}
+
 int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
 {
   picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
@@ -90,6 +453,7 @@ int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
   
   memset( &ev, 0, sizeof( ev ) );
   assert(PICOEV_FD_BELONGS_TO_LOOP(&loop->loop, fd));
+  PICOEV_PROBE3(update_events, fd, target->events, events);
   
   if ((events & PICOEV_READWRITE) == target->events) {
     return 0;
@@ -99,9 +463,10 @@ int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
     | ((events & PICOEV_WRITE) != 0 ? EPOLLOUT : 0);
   ev.data.fd = fd;
   
-#define SET(op, check_error) do {		    \
-    epoll_ret = epoll_ctl(loop->epfd, op, fd, &ev); \
-    assert(! check_error || epoll_ret == 0);	    \
+#define PICOEV_EPOLL_SET(op, check_error) do {                    \
+    PICOEV_STATS_ADD(&loop->loop, backend_calls, 1); \
+    epoll_ret = epoll_ctl(loop->epfd, op, fd, &ev);  \
+    assert(! check_error || epoll_ret == 0);         \
   } while (0)
   
 #if PICOEV_EPOLL_DEFER_DELETES
@@ -109,60 +474,161 @@ int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
   if ((events & PICOEV_DEL) != 0) {
     /* nothing to do */
   } else if ((events & PICOEV_READWRITE) == 0) {
-    SET(EPOLL_CTL_DEL, 1);
+    PICOEV_EPOLL_SET(EPOLL_CTL_DEL, 1);
   } else {
-    SET(EPOLL_CTL_MOD, 0);
+    PICOEV_EPOLL_SET(EPOLL_CTL_MOD, 0);
     if (epoll_ret != 0) {
       assert(errno == ENOENT);
-      SET(EPOLL_CTL_ADD, 1);
+      PICOEV_EPOLL_SET(EPOLL_CTL_ADD, 1);
+    }
+    if (epoll_ret != 0) {
+      return -1;
     }
   }
   
 #else
   
   if ((events & PICOEV_READWRITE) == 0) {
-    SET(EPOLL_CTL_DEL, 1);
+    PICOEV_EPOLL_SET(EPOLL_CTL_DEL, 1);
   } else {
-    SET(target->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, 1);
+    PICOEV_EPOLL_SET(target->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, 1);
+    if (epoll_ret != 0) {
+      return -1;
+    }
   }
   
 #endif
   
-#undef SET
+#undef PICOEV_EPOLL_SET
   
   target->events = events;
   
   return 0;
 }
 
+int picoev_update_events_many_internal(picoev_loop* _loop, const int* fds,
+				       const int* events, int flags, int n)
+{
+  picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
+  int i, r = 0;
+  
+#if PICOEV_EPOLL_URING
+  if (n > 1 && loop->uring.fd == -1 && picoev_epoll_setup_uring(loop) != 0) {
+    loop->uring.fd = -2;
+  }
+  if (n > 1 && loop->uring.fd >= 0) {
+    for (i = 0; i < n; ++i) {
+      int fd = fds[i], ev = (events != NULL ? events[i] : 0) | flags, op,
+	op_events;
+      picoev_fd* target = picoev.fds + fd;
+      if (loop->uring.fd < 0) {
+	/* the ring failed while flushing, apply the rest one by one */
+	if (picoev_update_events_internal(&loop->loop, fd, ev) != 0) {
+	  r = -1;
+	}
+	continue;
+      }
+      assert(PICOEV_FD_BELONGS_TO_LOOP(&loop->loop, fd));
+      PICOEV_PROBE3(update_events, fd, target->events, ev);
+      if ((ev & PICOEV_READWRITE) == target->events) {
+	continue;
+      }
+      /* same as picoev_update_events_internal, -1 if nothing to do */
+# if PICOEV_EPOLL_DEFER_DELETES
+      op = (ev & PICOEV_DEL) != 0 ? -1
+	: (ev & PICOEV_READWRITE) == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+# else
+      op = (ev & PICOEV_READWRITE) == 0 ? EPOLL_CTL_DEL
+	: target->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+# endif
+      /* update events first, being used by the retry if the push flushes
+	 (restored if the op fails) */
+      op_events = target->events;
+      target->events = ev & PICOEV_READWRITE;
+      if (op != -1
+	  && picoev_epoll_uring_push(loop, op, fd, ev, op_events) != 0) {
+	r = -1;
+      }
+    }
+    if (loop->uring.fd >= 0 && picoev_epoll_uring_flush(loop) != 0) {
+      r = -1;
+    }
+    return r;
+  }
+#endif
+  
+  for (i = 0; i < n; ++i) {
+    if (picoev_update_events_internal(&loop->loop, fds[i],
+				      (events != NULL ? events[i] : 0) | flags)
+	!= 0) {
+      r = -1;
+    }
+  }
+  return r;
+}
+
 int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
 {
   picoev_loop_epoll* loop = (picoev_loop_epoll*)_loop;
+  unsigned long long poll_start = picoev_stats_clock_internal();
   int i, nevents;
   
+  PICOEV_PROBE1(poll_enter, max_wait);
   nevents = epoll_wait(loop->epfd, loop->events,
 		       sizeof(loop->events) / sizeof(loop->events[0]),
 		       max_wait * 1000);
+  PICOEV_PROBE1(poll_exit, nevents);
   if (nevents == -1) {
     return -1;
   }
+  picoev_polled_internal(&loop->loop, nevents, poll_start);
+  /* the fds table is large and sparsely touched; keep the loads of a few
+     entries ahead in flight so that the misses overlap instead of
+     serializing with the callbacks (but not so many that they are evicted
+     before used) */
+  for (i = 0; i < nevents && i < PICOEV_PREFETCH_DISTANCE; ++i) {
+    PICOEV_PREFETCH(picoev.fds + loop->events[i].data.fd);
+  }
   for (i = 0; i < nevents; ++i) {
     struct epoll_event* event = loop->events + i;
     picoev_fd* target = picoev.fds + event->data.fd;
+    if (i + PICOEV_PREFETCH_DISTANCE < nevents) {
+      PICOEV_PREFETCH(picoev.fds
+		      + event[PICOEV_PREFETCH_DISTANCE].data.fd);
+    }
+    if (i + 1 < nevents) {
+      /* prefetch the user state of the next event (harmless if cb_arg is
+	 not a pointer) */
+      PICOEV_PREFETCH(picoev.fds[event[1].data.fd].cb_arg);
+    }
     if (loop->loop.loop_id == target->loop_id
 	&& (target->events & PICOEV_READWRITE) != 0) {
       int revents = ((event->events & EPOLLIN) != 0 ? PICOEV_READ : 0)
 	| ((event->events & EPOLLOUT) != 0 ? PICOEV_WRITE : 0);
       if (revents != 0) {
-	(*target->callback)(&loop->loop, event->data.fd, revents,
-			    target->cb_arg);
+	PICOEV_STATS_ADD(&loop->loop, events, 1);
+	picoev_call_internal(&loop->loop, event->data.fd, target, revents);
       }
     } else {
 #if PICOEV_EPOLL_DEFER_DELETES
       event->events = 0;
+      PICOEV_STATS_ADD(&loop->loop, backend_calls, 1);
       epoll_ctl(loop->epfd, EPOLL_CTL_DEL, event->data.fd, event);
 #endif
     }
   }
   return 0;
 }
+
+#ifdef PICOEV_MULTI_BACKEND
+const picoev_backend picoev_epoll_backend = {
+  "epoll",
+  picoev_create_loop,
+  picoev_destroy_loop,
+  picoev_update_events_internal,
+  picoev_update_events_many_internal,
+  picoev_poll_once_internal,
+  picoev_signal_add,
+  picoev_signal_del
+};
+#endif
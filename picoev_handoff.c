@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "picoev.h"
+
+#ifdef MSG_CMSG_CLOEXEC
+# define PICOEV_HANDOFF_RECV_FLAGS MSG_CMSG_CLOEXEC
+#else
+# define PICOEV_HANDOFF_RECV_FLAGS 0
+#endif
+
+typedef union {
+  struct cmsghdr hdr; /* for the alignment */
+  char buf[CMSG_SPACE(sizeof(int) * PICOEV_HANDOFF_MAX_FDS)];
+} picoev_handoff_cmsg;
+
+int picoev_handoff_send(int sock, const int* fds, int n)
+{
+  int sent = 0;
+  
+  /* each message carries the number of fds left for the messages after */
+  do {
+    int chunk = n - sent < PICOEV_HANDOFF_MAX_FDS
+      ? n - sent : PICOEV_HANDOFF_MAX_FDS, left = n - sent - chunk;
+    picoev_handoff_cmsg cmsg;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* c;
+    ssize_t r;
+    iov.iov_base = &left;
+    iov.iov_len = sizeof(left);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (chunk != 0) {
+      memset(&cmsg, 0, sizeof(cmsg));
+      msg.msg_control = cmsg.buf;
+      msg.msg_controllen = CMSG_SPACE(sizeof(int) * chunk);
+      c = CMSG_FIRSTHDR(&msg);
+      c->cmsg_level = SOL_SOCKET;
+      c->cmsg_type = SCM_RIGHTS;
+      c->cmsg_len = CMSG_LEN(sizeof(int) * chunk);
+      memcpy(CMSG_DATA(c), fds + sent, sizeof(int) * chunk);
+    }
+    while ((r = sendmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+      ;
+    if (r != sizeof(left)) {
+      return -1;
+    }
+    sent += chunk;
+  } while (sent < n);
+  return 0;
+}
+
+int picoev_handoff_recv(int sock, int* fds, int max_fds)
+{
+  int n = 0, left, lost = 0, i, num, fd;
+  
+  do {
+    picoev_handoff_cmsg cmsg;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* c;
+    ssize_t r;
+    iov.iov_base = &left;
+    iov.iov_len = sizeof(left);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg.buf;
+    msg.msg_controllen = sizeof(cmsg.buf);
+    while ((r = recvmsg(sock, &msg, PICOEV_HANDOFF_RECV_FLAGS)) == -1
+	   && errno == EINTR)
+      ;
+    if (r <= 0) {
+      if (r == 0) {
+	errno = ECONNRESET;
+      }
+      goto Error;
+    }
+    /* take the fds even of a short message, so that they get closed */
+    for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+	continue;
+      }
+      num = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (i = 0; i < num; ++i) {
+	memcpy(&fd, CMSG_DATA(c) + sizeof(int) * i, sizeof(int));
+#if PICOEV_HANDOFF_RECV_FLAGS == 0
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+	if (n < max_fds) {
+	  fds[n++] = fd;
+	} else {
+	  close(fd);
+	  lost = 1;
+	}
+      }
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) != 0) {
+      lost = 1;
+    }
+    if (r != sizeof(left)) {
+      errno = EPROTO;
+      goto Error;
+    }
+  } while (left != 0);
+  if (lost) {
+    errno = EMSGSIZE;
+    goto Error;
+  }
+  return n;
+  
+ Error:
+  while (n != 0) {
+    close(fds[--n]);
+  }
+  return -1;
+}
+
+/* connections are the sockets not listening, leaving signalfd, pidfd, etc.
+   alone */
+static int picoev_is_connection(int fd)
+{
+  struct stat st;
+  int listening = 0;
+  socklen_t len = sizeof(listening);
+  
+  if (fstat(fd, &st) != 0 || ! S_ISSOCK(st.st_mode)) {
+    return 0;
+  }
+#ifdef SO_ACCEPTCONN
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0
+      && listening != 0) {
+    return 0;
+  }
+#endif
+  return 1;
+}
+
+/* returns the deadline of the timeout set by the application, 0 if none */
+static time_t picoev_timeout_of(picoev_loop* loop, int fd)
+{
+  picoev_rate_limit* limit = picoev_rate_limit_of_internal(loop, fd);
+  picoev_fd_cold* cold = PICOEV_FD_COLD(fd);
+  
+  if (limit != NULL && limit->throttled != 0) {
+    return limit->timeout_at;
+  }
+  return cold->timeout_idx != PICOEV_TIMEOUT_IDX_UNUSED ? cold->timeout_at : 0;
+}
+
+int picoev_drain(picoev_loop* loop, int timeout_in_secs)
+{
+  int* conns, num_conns = 0, fd, i, j;
+  time_t at, give_up_at;
+  
+  /* 0 would clear the timeouts (see picoev_set_timeout) instead of capping
+     them */
+  assert(timeout_in_secs > 0);
+  if ((conns = (int*)malloc(sizeof(int)
+			    * (picoev_loop_active_count(loop) + 1)))
+      == NULL) {
+    return -1;
+  }
+  loop->now = time(NULL);
+  for (fd = -1; (fd = picoev_next_fd(loop, fd)) != -1; ) {
+    if (picoev_is_connection(fd)) {
+      conns[num_conns++] = fd;
+      if ((at = picoev_timeout_of(loop, fd)) == 0
+	  || at > loop->now + timeout_in_secs) {
+	picoev_set_timeout(loop, fd, timeout_in_secs);
+      }
+    }
+  }
+  /* the wheel fires up to one resolution late */
+  give_up_at = loop->now + timeout_in_secs + loop->timeout.resolution;
+  while (num_conns != 0 && loop->now <= give_up_at) {
+    if (picoev_loop_once(loop, 1) != 0) {
+      free(conns);
+      return -1;
+    }
+    for (i = j = 0; i < num_conns; ++i) {
+      if (picoev_is_active(loop, conns[i])) {
+	conns[j++] = conns[i];
+      }
+    }
+    num_conns = j;
+  }
+  free(conns);
+  return num_conns;
+}
+
+#endif
@@ -28,18 +28,20 @@
  */
 
 #include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
 #include <unistd.h>
+#define PICOEV_BACKEND_NAME kqueue
 #include "picoev.h"
 
-#define EV_QUEUE_SZ 128
+#define PICOEV_KQUEUE_QUEUE_SZ 128
 
-#define BACKEND_BUILD(next_fd, events)	\
+#define PICOEV_KQUEUE_BACKEND_BUILD(next_fd, events)	\
   ((unsigned)((next_fd << 8) | (events & 0xff)))
-#define BACKEND_GET_NEXT_FD(backend) ((int)(backend) >> 8)
-#define BACKEND_GET_OLD_EVENTS(backend) ((int)(backend) & 0xff)
+#define PICOEV_KQUEUE_NEXT_FD(backend) ((int)(backend) >> 8)
+#define PICOEV_KQUEUE_OLD_EVENTS(backend) ((int)(backend) & 0xff)
 
 typedef struct picoev_loop_kqueue_st {
   picoev_loop loop;
@@ -47,13 +49,20 @@ typedef struct picoev_loop_kqueue_st {
   int changed_fds; /* link list using picoev_fd::_backend, -1 if not changed */
   struct kevent events[1024];
   struct kevent changelist[256];
+  struct {
+    picoev_signal_handler* callback;
+    void* cb_arg;
+    struct sigaction old_action;
+  } signal_handlers[NSIG];
 } picoev_loop_kqueue;
 
-picoev_globals picoev;
+#ifndef PICOEV_MULTI_BACKEND
+picoev_globals picoev; /* defined by picoev_backend.c otherwise */
+#endif
 
-static int apply_pending_changes(picoev_loop_kqueue* loop, int apply_all)
+static int picoev_kqueue_apply_changes(picoev_loop_kqueue* loop, int apply_all)
 {
-#define SET(op, events)						\
+#define PICOEV_KQUEUE_SET(op, events)				\
   EV_SET(loop->changelist + cl_off++, loop->changed_fds,	\
 	 (((events) & PICOEV_READ) != 0 ? EVFILT_READ : 0)	\
 	 | (((events) & PICOEV_WRITE) != 0 ? EVFILT_WRITE : 0), \
@@ -63,26 +72,29 @@ static int apply_pending_changes(picoev_loop_kqueue* loop, int apply_all)
   
   while (loop->changed_fds != -1) {
     picoev_fd* changed = picoev.fds + loop->changed_fds;
-    int old_events = BACKEND_GET_OLD_EVENTS(changed->_backend);
+    picoev_fd_cold* changed_cold = PICOEV_FD_COLD(loop->changed_fds);
+    int old_events = PICOEV_KQUEUE_OLD_EVENTS(changed_cold->_backend);
     if (changed->events != old_events) {
       if (old_events != 0) {
-	SET(EV_DISABLE, old_events);
+	PICOEV_KQUEUE_SET(EV_DISABLE, old_events);
       }
       if (changed->events != 0) {
-	SET(EV_ADD | EV_ENABLE, changed->events);
+	PICOEV_KQUEUE_SET(EV_ADD | EV_ENABLE, changed->events);
       }
       if ((size_t)cl_off + 1
 	  >= sizeof(loop->changelist) / sizeof(loop->changelist[0])) {
+	PICOEV_STATS_ADD(&loop->loop, backend_calls, 1);
 	nevents = kevent(loop->kq, loop->changelist, cl_off, NULL, 0, NULL);
 	assert(nevents == 0);
 	cl_off = 0;
       }
     }
-    loop->changed_fds = BACKEND_GET_NEXT_FD(changed->_backend);
-    changed->_backend = -1;
+    loop->changed_fds = PICOEV_KQUEUE_NEXT_FD(changed_cold->_backend);
+    changed_cold->_backend = -1;
   }
   
   if (apply_all && cl_off != 0) {
+    PICOEV_STATS_ADD(&loop->loop, backend_calls, 1);
     nevents = kevent(loop->kq, loop->changelist, cl_off, NULL, 0, NULL);
     assert(nevents == 0);
     cl_off = 0;
@@ -90,7 +102,7 @@ static int apply_pending_changes(picoev_loop_kqueue* loop, int apply_all)
   
   return cl_off;
   
-#undef SET
+#undef PICOEV_KQUEUE_SET
 }
 
 picoev_loop* picoev_create_loop(int max_timeout)
@@ -115,6 +127,7 @@ picoev_loop* picoev_create_loop(int max_timeout)
     return NULL;
   }
   loop->changed_fds = -1;
+  memset(loop->signal_handlers, 0, sizeof(loop->signal_handlers));
   
   loop->loop.now = time(NULL);
   return &loop->loop;
@@ -123,7 +136,13 @@ picoev_loop* picoev_create_loop(int max_timeout)
 int picoev_destroy_loop(picoev_loop* _loop)
 {
   picoev_loop_kqueue* loop = (picoev_loop_kqueue*)_loop;
+  int signo;
   
+  for (signo = 1; signo < NSIG; ++signo) {
+    if (loop->signal_handlers[signo].callback != NULL) {
+      sigaction(signo, &loop->signal_handlers[signo].old_action, NULL);
+    }
+  }
   if (close(loop->kq) != 0) {
     return -1;
   }
@@ -132,33 +151,111 @@ int picoev_destroy_loop(picoev_loop* _loop)
   return 0;
 }
 
-int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
+int picoev_signal_add(picoev_loop* _loop, int signo,
+		      picoev_signal_handler* callback, void* cb_arg)
+{
+  picoev_loop_kqueue* loop = (picoev_loop_kqueue*)_loop;
+  struct sigaction sa;
+  struct kevent kev;
+  
+  assert(0 < signo && signo < NSIG);
+  assert(loop->signal_handlers[signo].callback == NULL);
+  
+  /* EVFILT_SIGNAL observes the signal after its disposition is applied, so
+     ignore it to keep the default action from running */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  if (sigaction(signo, &sa, &loop->signal_handlers[signo].old_action) != 0) {
+    return -1;
+  }
+  EV_SET(&kev, signo, EVFILT_SIGNAL, EV_ADD | EV_ENABLE, 0, 0, NULL);
+  if (kevent(loop->kq, &kev, 1, NULL, 0, NULL) != 0) {
+    sigaction(signo, &loop->signal_handlers[signo].old_action, NULL);
+    return -1;
+  }
+  loop->signal_handlers[signo].callback = callback;
+  loop->signal_handlers[signo].cb_arg = cb_arg;
+  
+  return 0;
+}
+
+int picoev_signal_del(picoev_loop* _loop, int signo)
 {
   picoev_loop_kqueue* loop = (picoev_loop_kqueue*)_loop;
+  struct kevent kev;
+  
+  assert(0 < signo && signo < NSIG);
+  assert(loop->signal_handlers[signo].callback != NULL);
+  
+  EV_SET(&kev, signo, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+  if (kevent(loop->kq, &kev, 1, NULL, 0, NULL) != 0) {
+    return -1;
+  }
+  sigaction(signo, &loop->signal_handlers[signo].old_action, NULL);
+  loop->signal_handlers[signo].callback = NULL;
+  loop->signal_handlers[signo].cb_arg = NULL;
+  
+  return 0;
+}
+
+/* queues the change, returns if anything was queued */
+static int picoev_kqueue_queue_change(picoev_loop_kqueue* loop, int fd,
+				      int events)
+{
   picoev_fd* target = picoev.fds + fd;
+  picoev_fd_cold* cold = PICOEV_FD_COLD(fd);
   
   assert(PICOEV_FD_BELONGS_TO_LOOP(&loop->loop, fd));
+  PICOEV_PROBE3(update_events, fd, target->events, events);
   
   /* initialize if adding the fd */
   if ((events & PICOEV_ADD) != 0) {
-    target->_backend = -1;
+    cold->_backend = -1;
   }
   /* return if nothing to do */
   if (events == PICOEV_DEL
-      ? target->_backend == -1
+      ? cold->_backend == -1
       : (events & PICOEV_READWRITE) == target->events) {
     return 0;
   }
   /* add to changed list if not yet being done */
-  if (target->_backend == -1) {
-    target->_backend = BACKEND_BUILD(loop->changed_fds, target->events);
+  if (cold->_backend == -1) {
+    cold->_backend = PICOEV_KQUEUE_BACKEND_BUILD(loop->changed_fds,
+						 target->events);
     loop->changed_fds = fd;
   }
   /* update events */
   target->events = events & PICOEV_READWRITE;
+  
+  return 1;
+}
+
+int picoev_update_events_internal(picoev_loop* _loop, int fd, int events)
+{
+  picoev_loop_kqueue* loop = (picoev_loop_kqueue*)_loop;
+  
   /* apply immediately if is a DELETE */
-  if ((events & PICOEV_DEL) != 0) {
-    apply_pending_changes(loop, 1);
+  if (picoev_kqueue_queue_change(loop, fd, events)
+      && (events & PICOEV_DEL) != 0) {
+    picoev_kqueue_apply_changes(loop, 1);
+  }
+  
+  return 0;
+}
+
+int picoev_update_events_many_internal(picoev_loop* _loop, const int* fds,
+				       const int* events, int flags, int n)
+{
+  picoev_loop_kqueue* loop = (picoev_loop_kqueue*)_loop;
+  int i, queued = 0;
+  
+  for (i = 0; i < n; ++i) {
+    queued |= picoev_kqueue_queue_change(loop, fds[i],
+			   (events != NULL ? events[i] : 0) | flags);
+  }
+  /* DELETEs are applied immediately, in a single call */
+  if (queued && (flags & PICOEV_DEL) != 0) {
+    picoev_kqueue_apply_changes(loop, 1);
   }
   
   return 0;
@@ -168,24 +265,52 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
 {
   picoev_loop_kqueue* loop = (picoev_loop_kqueue*)_loop;
   struct timespec ts;
+  unsigned long long poll_start;
   int cl_off = 0, nevents, i;
   
   /* apply pending changes, with last changes stored to loop->changelist */
-  cl_off = apply_pending_changes(loop, 0);
+  cl_off = picoev_kqueue_apply_changes(loop, 0);
+  if (cl_off != 0) {
+    PICOEV_STATS_ADD(&loop->loop, backend_calls, 1);
+  }
   
   ts.tv_sec = max_wait;
   ts.tv_nsec = 0;
+  poll_start = picoev_stats_clock_internal();
+  PICOEV_PROBE1(poll_enter, max_wait);
   nevents = kevent(loop->kq, loop->changelist, cl_off, loop->events,
 		   sizeof(loop->events) / sizeof(loop->events[0]), &ts);
+  PICOEV_PROBE1(poll_exit, nevents);
   if (nevents == -1) {
     /* the errors we can only rescue */
     assert(errno == EACCES || errno == EFAULT || errno == EINTR);
     return -1;
   }
+  picoev_polled_internal(&loop->loop, nevents, poll_start);
+  /* see picoev_epoll.c */
+  for (i = 0; i < nevents && i < PICOEV_PREFETCH_DISTANCE; ++i) {
+    PICOEV_PREFETCH(picoev.fds + loop->events[i].ident);
+  }
   for (i = 0; i < nevents; ++i) {
     struct kevent* event = loop->events + i;
     picoev_fd* target = picoev.fds + event->ident;
+    if (i + PICOEV_PREFETCH_DISTANCE < nevents) {
+      PICOEV_PREFETCH(picoev.fds + event[PICOEV_PREFETCH_DISTANCE].ident);
+    }
+    if (i + 1 < nevents && event[1].filter != EVFILT_SIGNAL) {
+      PICOEV_PREFETCH(picoev.fds[event[1].ident].cb_arg);
+    }
     assert((event->flags & EV_ERROR) == 0); /* changelist errors are fatal */
+    if (event->filter == EVFILT_SIGNAL) {
+      /* pending signals are coalesced by the kernel (count in data) */
+      int signo = event->ident;
+      if (loop->signal_handlers[signo].callback != NULL) {
+	(*loop->signal_handlers[signo].callback)(&loop->loop, signo,
+						 loop->signal_handlers[signo]
+						 .cb_arg);
+      }
+      continue;
+    }
     if (loop->loop.loop_id == target->loop_id
 	&& (event->filter & (EVFILT_READ | EVFILT_WRITE)) != 0) {
       int revents;
@@ -201,9 +326,23 @@ int picoev_poll_once_internal(picoev_loop* _loop, int max_wait)
 	revents = 0; // suppress compiler warning
 	break;
       }
-      (*target->callback)(&loop->loop, event->ident, revents, target->cb_arg);
+      PICOEV_STATS_ADD(&loop->loop, events, 1);
+      picoev_call_internal(&loop->loop, event->ident, target, revents);
     }
   }
   
   return 0;
 }
+
+#ifdef PICOEV_MULTI_BACKEND
+const picoev_backend picoev_kqueue_backend = {
+  "kqueue",
+  picoev_create_loop,
+  picoev_destroy_loop,
+  picoev_update_events_internal,
+  picoev_update_events_many_internal,
+  picoev_poll_once_internal,
+  picoev_signal_add,
+  picoev_signal_del
+};
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/syscall.h>
+#endif
+#include "picoev.h"
+
+#define PICOEV_ACCEPT_BATCH 64 /* max. # of connections accepted per event */
+
+static int picoev_listener_open_reserve(void)
+{
+  return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+static int picoev_accept_nonblock(int fd)
+{
+#if defined(SYS_accept4) && defined(SOCK_NONBLOCK)
+  return syscall(SYS_accept4, fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int newfd;
+  if ((newfd = accept(fd, NULL, NULL)) != -1) {
+    fcntl(newfd, F_SETFL, O_NONBLOCK);
+    fcntl(newfd, F_SETFD, FD_CLOEXEC);
+  }
+  return newfd;
+#endif
+}
+
+/* watches the listening socket unless paused */
+static void picoev_listener_update_events(picoev_listener* listener)
+{
+  picoev_set_events(listener->loop, listener->fd,
+		    listener->paused != 0 ? 0 : PICOEV_READ);
+}
+
+static void picoev_listener_pause(picoev_listener* listener, int reason)
+{
+  listener->paused |= reason;
+  picoev_listener_update_events(listener);
+}
+
+static void picoev_listener_resume(picoev_listener* listener, int reason)
+{
+  if ((listener->paused & reason) != 0) {
+    listener->paused &= ~reason;
+    picoev_listener_update_events(listener);
+  }
+}
+
+/* out of fds: lets the client know by closing the pending connection instead
+   of leaving it in the backlog, then stops accepting for a while */
+static void picoev_listener_back_off(picoev_listener* listener, int newfd)
+{
+  if (newfd != -1) {
+    close(newfd);
+    ++listener->num_dropped;
+  } else if (listener->reserve_fd != -1) {
+    close(listener->reserve_fd);
+    if ((newfd = accept(listener->fd, NULL, NULL)) != -1) {
+      close(newfd);
+      ++listener->num_dropped;
+    }
+    listener->reserve_fd = picoev_listener_open_reserve();
+  }
+  listener->backoff_secs = listener->backoff_secs == 0 ? 1
+    : listener->backoff_secs * 2 < PICOEV_LISTENER_MAX_BACKOFF
+    ? listener->backoff_secs * 2 : PICOEV_LISTENER_MAX_BACKOFF;
+  picoev_set_timeout(listener->loop, listener->fd, listener->backoff_secs);
+  picoev_listener_pause(listener, PICOEV_LISTENER_PAUSED_BACKOFF);
+}
+
+static void picoev_listener_callback(picoev_loop* loop, int fd, int revents,
+				     void* cb_arg)
+{
+  picoev_listener* listener = (picoev_listener*)cb_arg;
+  int i, newfd;
+  
+  if ((revents & PICOEV_TIMEOUT) != 0) {
+    /* the pause is over (the backoff doubles if still out of fds) */
+    if (listener->reserve_fd == -1) {
+      listener->reserve_fd = picoev_listener_open_reserve();
+    }
+    picoev_listener_resume(listener, PICOEV_LISTENER_PAUSED_BACKOFF);
+    return;
+  }
+  
+  for (i = 0; i < PICOEV_ACCEPT_BATCH && listener->paused == 0; ++i) {
+    if ((newfd = picoev_accept_nonblock(fd)) == -1) {
+      if (errno == EMFILE || errno == ENFILE) {
+	picoev_listener_back_off(listener, -1);
+      } else if (errno == EINTR || errno == ECONNABORTED) {
+	continue;
+      }
+      break;
+    }
+    if (newfd >= picoev.max_fd) {
+      picoev_listener_back_off(listener, newfd);
+      break;
+    }
+    listener->backoff_secs = 0;
+    ++listener->num_accepted;
+    ++listener->num_conns;
+    if (listener->max_conns != 0
+	&& listener->num_conns >= listener->max_conns) {
+      picoev_listener_pause(listener, PICOEV_LISTENER_PAUSED_LIMIT);
+    }
+    (*listener->callback)(loop, newfd, listener->cb_arg);
+  }
+}
+
+picoev_listener* picoev_listener_add(picoev_loop* loop, int fd,
+				     picoev_accept_handler* callback,
+				     void* cb_arg)
+{
+  picoev_listener* listener;
+  
+  if ((listener = (picoev_listener*)malloc(sizeof(picoev_listener)))
+      == NULL) {
+    return NULL;
+  }
+  memset(listener, 0, sizeof(*listener));
+  listener->loop = loop;
+  listener->fd = fd;
+  listener->callback = callback;
+  listener->cb_arg = cb_arg;
+  if ((listener->reserve_fd = picoev_listener_open_reserve()) == -1
+      || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1
+      || picoev_add(loop, fd, PICOEV_READ, 0, picoev_listener_callback,
+		    listener)
+      != 0) {
+    if (listener->reserve_fd != -1) {
+      close(listener->reserve_fd);
+    }
+    free(listener);
+    return NULL;
+  }
+  return listener;
+}
+
+void picoev_listener_del(picoev_listener* listener)
+{
+  picoev_del(listener->loop, listener->fd);
+  if (listener->reserve_fd != -1) {
+    close(listener->reserve_fd);
+  }
+  free(listener);
+}
+
+void picoev_listener_set_limit(picoev_listener* listener, int max_conns,
+			       int resume_conns)
+{
+  assert(max_conns == 0 || (0 <= resume_conns && resume_conns < max_conns));
+  listener->max_conns = max_conns;
+  listener->resume_conns = resume_conns;
+  if (max_conns != 0 && listener->num_conns >= max_conns) {
+    picoev_listener_pause(listener, PICOEV_LISTENER_PAUSED_LIMIT);
+  } else {
+    picoev_listener_resume(listener, PICOEV_LISTENER_PAUSED_LIMIT);
+  }
+}
+
+void picoev_listener_release(picoev_listener* listener)
+{
+  assert(listener->num_conns > 0);
+  if (--listener->num_conns <= listener->resume_conns) {
+    picoev_listener_resume(listener, PICOEV_LISTENER_PAUSED_LIMIT);
+  }
+  /* an fd has been freed */
+  if ((listener->paused & PICOEV_LISTENER_PAUSED_BACKOFF) != 0) {
+    if (listener->reserve_fd == -1) {
+      listener->reserve_fd = picoev_listener_open_reserve();
+    }
+    picoev_set_timeout(listener->loop, listener->fd, 0);
+    picoev_listener_resume(listener, PICOEV_LISTENER_PAUSED_BACKOFF);
+  }
+}
+
+#endif
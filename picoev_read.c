@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2009, Cybozu Labs, Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * * Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ * * Neither the name of the <ORGANIZATION> nor the names of its contributors
+ *   may be used to endorse or promote products derived from this software
+ *   without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <unistd.h>
+#include "picoev.h"
+
+int picoev_read_start(picoev_loop* loop, int fd, int timeout_in_secs,
+		      picoev_data_handler* callback, void* cb_arg)
+{
+  assert(PICOEV_IS_INITED_AND_FD_IN_RANGE(fd));
+  if (loop->read.handlers == NULL
+      && (loop->read.handlers = (picoev_data_handler**)
+	  picoev_alloc_table_internal(sizeof(picoev_data_handler*)
+				      * picoev.max_fd, PICOEV_ALLOC_READ,
+				      &loop->read._free_addr))
+      == NULL) {
+    return -1;
+  }
+  loop->read.handlers[fd] = callback;
+  return picoev_add(loop, fd, PICOEV_READ, timeout_in_secs,
+		    picoev_read_callback_internal, cb_arg);
+}
+
+void picoev_read_callback_internal(picoev_loop* loop, int fd, int revents,
+				   void* cb_arg)
+{
+  picoev_data_handler* callback = loop->read.handlers[fd];
+  char* buf;
+  ssize_t r;
+  
+  if ((revents & PICOEV_TIMEOUT) != 0) {
+    errno = ETIMEDOUT;
+    (*callback)(loop, fd, NULL, -1, cb_arg);
+    return;
+  }
+  /* take a buffer from the pool, usually the one used by the last read */
+  if ((buf = (char*)loop->read.free_bufs) != NULL) {
+    loop->read.free_bufs = *(void**)buf;
+  } else if ((buf = (char*)picoev_alloc_internal(PICOEV_READ_BUF_SIZE,
+						 PICOEV_ALLOC_READ))
+	     == NULL) {
+    errno = ENOMEM;
+    (*callback)(loop, fd, NULL, -1, cb_arg);
+    return;
+  }
+  /* a single read per event, so that other fds are not starved */
+  while ((r = read(fd, buf, PICOEV_READ_BUF_SIZE)) == -1 && errno == EINTR)
+    ;
+  if (r != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    (*callback)(loop, fd, buf, r, cb_arg);
+  }
+  /* and return it */
+  *(void**)buf = loop->read.free_bufs;
+  loop->read.free_bufs = buf;
+}
+
+#endif
@@ -28,11 +28,16 @@
  */
 
 #ifndef _WIN32
+# include <errno.h>
+# include <fcntl.h>
+# include <signal.h>
 # include <sys/select.h>
+# include <unistd.h>
 #else
 # include <ws2tcpip.h>
 #endif
 
+#define PICOEV_BACKEND_NAME select
 #include "picoev.h"
 
 #ifdef _WIN32
@@ -86,60 +91,250 @@ int picoev_w32_deinit(void) {
 # define PICOEV_FD_ISSET(x, y) FD_ISSET(x, y)
 #endif
 
-picoev_globals picoev;
+typedef struct picoev_loop_select_st {
+  picoev_loop loop;
+#ifndef _WIN32
+  struct {
+    int pipe_fds[2]; /* self-pipe, -1 if not yet created */
+    struct {
+      picoev_signal_handler* callback;
+      void* cb_arg;
+      struct sigaction old_action;
+    } handlers[NSIG];
+  } signal;
+#endif
+} picoev_loop_select;
+
+#ifndef PICOEV_MULTI_BACKEND
+picoev_globals picoev; /* defined by picoev_backend.c otherwise */
+#endif
+
+#ifndef _WIN32
+
+/* write end of the self-pipe of the loop watching each signal, or 0 if
+   none (the write end of a pipe is never fd 0). The handler is process-wide,
+   so a signal can be watched by only one loop at a time */
+static int picoev_select_signal_pipe_of[NSIG];
+
+static void picoev_select_signal_notify(int signo)
+{
+  int save_errno = errno;
+  unsigned char c = (unsigned char)signo;
+  if (write(picoev_select_signal_pipe_of[signo], &c, 1) == -1) {
+    /* pipe is full, the loop already has pending notifications */
+  }
+  errno = save_errno;
+}
+
+static void picoev_select_signal_callback(picoev_loop* _loop, int fd,
+					  int revents __attribute__((unused)),
+					  void* cb_arg __attribute__((unused)))
+{
+  picoev_loop_select* loop = (picoev_loop_select*)_loop;
+  unsigned char buf[256], seen[NSIG];
+  ssize_t r, i;
+  
+  /* drain all pending signals, dispatching each signal once like signalfd
+     does */
+  memset(seen, 0, sizeof(seen));
+  do {
+    if ((r = read(fd, buf, sizeof(buf))) <= 0) {
+      break;
+    }
+    for (i = 0; i < r; ++i) {
+      int signo = buf[i];
+      if (signo < NSIG && ! seen[signo]
+	  && loop->signal.handlers[signo].callback != NULL) {
+	seen[signo] = 1;
+	(*loop->signal.handlers[signo].callback)(&loop->loop, signo,
+						 loop->signal.handlers[signo]
+						 .cb_arg);
+      }
+    }
+  } while (r == sizeof(buf));
+}
+
+static int picoev_select_signal_init_pipe(picoev_loop_select* loop)
+{
+  int i;
+  if (pipe(loop->signal.pipe_fds) != 0) {
+    loop->signal.pipe_fds[0] = -1;
+    return -1;
+  }
+  for (i = 0; i < 2; ++i) {
+    fcntl(loop->signal.pipe_fds[i], F_SETFL, O_NONBLOCK);
+    fcntl(loop->signal.pipe_fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  if (picoev_add(&loop->loop, loop->signal.pipe_fds[0], PICOEV_READ, 0,
+		 picoev_select_signal_callback, NULL) != 0) {
+    close(loop->signal.pipe_fds[0]);
+    close(loop->signal.pipe_fds[1]);
+    loop->signal.pipe_fds[0] = -1;
+    return -1;
+  }
+  return 0;
+}
+
+#endif
 
 picoev_loop* picoev_create_loop(int max_timeout)
 {
-  picoev_loop* loop;
+  picoev_loop_select* loop;
   
   assert(PICOEV_IS_INITED);
-  if ((loop = (picoev_loop*)malloc(sizeof(picoev_loop))) == NULL) {
+  if ((loop = (picoev_loop_select*)malloc(sizeof(picoev_loop_select)))
+      == NULL) {
     return NULL;
   }
-  if (picoev_init_loop_internal(loop, max_timeout) != 0) {
+  if (picoev_init_loop_internal(&loop->loop, max_timeout) != 0) {
     free(loop);
     return NULL;
   }
+#ifndef _WIN32
+  loop->signal.pipe_fds[0] = loop->signal.pipe_fds[1] = -1;
+  memset(loop->signal.handlers, 0, sizeof(loop->signal.handlers));
+#endif
   
-  loop->now = time(NULL);
-  return loop;
+  loop->loop.now = time(NULL);
+  return &loop->loop;
 }
 
-int picoev_destroy_loop(picoev_loop* loop)
+int picoev_destroy_loop(picoev_loop* _loop)
 {
-  picoev_deinit_loop_internal(loop);
+  picoev_loop_select* loop = (picoev_loop_select*)_loop;
+  
+#ifndef _WIN32
+  if (loop->signal.pipe_fds[0] != -1) {
+    int signo;
+    for (signo = 1; signo < NSIG; ++signo) {
+      if (loop->signal.handlers[signo].callback != NULL) {
+	picoev_signal_del(&loop->loop, signo);
+      }
+    }
+    picoev_del(&loop->loop, loop->signal.pipe_fds[0]);
+    close(loop->signal.pipe_fds[0]);
+    close(loop->signal.pipe_fds[1]);
+  }
+#endif
+  picoev_deinit_loop_internal(&loop->loop);
   free(loop);
   return 0;
 }
 
+#ifndef _WIN32
+
+int picoev_signal_add(picoev_loop* _loop, int signo,
+		      picoev_signal_handler* callback, void* cb_arg)
+{
+  picoev_loop_select* loop = (picoev_loop_select*)_loop;
+  struct sigaction sa;
+  
+  assert(0 < signo && signo < NSIG);
+  assert(loop->signal.handlers[signo].callback == NULL);
+  /* the signal must not be watched by another loop */
+  assert(picoev_select_signal_pipe_of[signo] == 0
+	 || picoev_select_signal_pipe_of[signo] == loop->signal.pipe_fds[1]);
+  
+  if (picoev_select_signal_pipe_of[signo] != 0
+      && picoev_select_signal_pipe_of[signo] != loop->signal.pipe_fds[1]) {
+    return -1;
+  }
+  if (loop->signal.pipe_fds[0] == -1
+      && picoev_select_signal_init_pipe(loop) != 0) {
+    return -1;
+  }
+  picoev_select_signal_pipe_of[signo] = loop->signal.pipe_fds[1];
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = picoev_select_signal_notify;
+  sa.sa_flags = SA_RESTART;
+  sigfillset(&sa.sa_mask);
+  if (sigaction(signo, &sa, &loop->signal.handlers[signo].old_action) != 0) {
+    picoev_select_signal_pipe_of[signo] = 0;
+    return -1;
+  }
+  loop->signal.handlers[signo].callback = callback;
+  loop->signal.handlers[signo].cb_arg = cb_arg;
+  
+  return 0;
+}
+
+int picoev_signal_del(picoev_loop* _loop, int signo)
+{
+  picoev_loop_select* loop = (picoev_loop_select*)_loop;
+  
+  assert(0 < signo && signo < NSIG);
+  assert(loop->signal.handlers[signo].callback != NULL);
+  
+  if (sigaction(signo, &loop->signal.handlers[signo].old_action, NULL)
+      != 0) {
+    return -1;
+  }
+  picoev_select_signal_pipe_of[signo] = 0;
+  loop->signal.handlers[signo].callback = NULL;
+  loop->signal.handlers[signo].cb_arg = NULL;
+  
+  return 0;
+}
+
+#else
+
+int picoev_signal_add(picoev_loop* loop, int signo,
+		      picoev_signal_handler* callback, void* cb_arg)
+{
+  return -1;
+}
+
+int picoev_signal_del(picoev_loop* loop, int signo)
+{
+  return -1;
+}
+
+#endif
+
 int picoev_update_events_internal(picoev_loop* loop, int fd, int events)
 {
+  PICOEV_PROBE3(update_events, fd, picoev.fds[fd].events, events);
   picoev.fds[fd].events = events & PICOEV_READWRITE;
   return 0;
 }
 
+int picoev_update_events_many_internal(picoev_loop* loop, const int* fds,
+				       const int* events, int flags, int n)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    picoev_update_events_internal(loop, fds[i],
+				  (events != NULL ? events[i] : 0) | flags);
+  }
+  return 0;
+}
+
 int picoev_poll_once_internal(picoev_loop* loop, int max_wait)
 {
   fd_set readfds, writefds, errorfds;
   struct timeval tv;
+  unsigned long long poll_start;
+  unsigned long vv, v;
+  size_t j, vi;
   int i, r, maxfd = 0;
   
-  /* setup */
+  /* setup, in the order of fds */
   FD_ZERO(&readfds);
   FD_ZERO(&writefds);
   FD_ZERO(&errorfds);
-  for (i = 0; i < picoev.max_fd; ++i) {
-    picoev_fd* fd = picoev.fds + i;
-    if (fd->loop_id == loop->loop_id) {
-      if ((fd->events & PICOEV_READ) != 0) {
-	PICOEV_FD_SET(i, &readfds);
-	if (maxfd < i) {
+  for (j = 0; j < picoev.active_vec_of_vec_size; ++j) {
+    for (vv = loop->active.vec_of_vec[j]; vv != 0; vv &= vv - 1) {
+      vi = j * PICOEV_LONG_BITS + PICOEV_CTZL(vv);
+      for (v = loop->active.vec[vi]; v != 0; v &= v - 1) {
+	picoev_fd* fd;
+	i = (int)(vi * PICOEV_LONG_BITS + PICOEV_CTZL(v));
+	fd = picoev.fds + i;
+	if ((fd->events & PICOEV_READ) != 0) {
+	  PICOEV_FD_SET(i, &readfds);
 	  maxfd = i;
 	}
-      }
-      if ((fd->events & PICOEV_WRITE) != 0) {
-	PICOEV_FD_SET(i, &writefds);
-	if (maxfd < i) {
+	if ((fd->events & PICOEV_WRITE) != 0) {
+	  PICOEV_FD_SET(i, &writefds);
 	  maxfd = i;
 	}
       }
@@ -149,17 +344,34 @@ int picoev_poll_once_internal(picoev_loop* loop, int max_wait)
   /* select and handle if any */
   tv.tv_sec = max_wait;
   tv.tv_usec = 0;
+  poll_start = picoev_stats_clock_internal();
+  PICOEV_PROBE1(poll_enter, max_wait);
   r = select(maxfd + 1, &readfds, &writefds, &errorfds, &tv);
+  PICOEV_PROBE1(poll_exit, r);
   if (r == -1) {
     return -1;
-  } else if (r > 0) {
-    for (i = 0; i < picoev.max_fd; ++i) {
-      picoev_fd* target = picoev.fds + i;
-      if (target->loop_id == loop->loop_id) {
-	int revents = (PICOEV_FD_ISSET(i, &readfds) ? PICOEV_READ : 0)
-	  | (PICOEV_FD_ISSET(i, &writefds) ? PICOEV_WRITE : 0);
-	if (revents != 0) {
-	  (*target->callback)(loop, i, revents, target->cb_arg);
+  }
+  picoev_polled_internal(loop, r, poll_start);
+  if (r > 0) {
+    /* iterates over a snapshot of the bitmap since the handlers may
+       unregister fds, hence the check of loop_id */
+    for (j = 0; j < picoev.active_vec_of_vec_size; ++j) {
+      for (vv = loop->active.vec_of_vec[j]; vv != 0; vv &= vv - 1) {
+	vi = j * PICOEV_LONG_BITS + PICOEV_CTZL(vv);
+	for (v = loop->active.vec[vi]; v != 0; v &= v - 1) {
+	  picoev_fd* target;
+	  int revents;
+	  i = (int)(vi * PICOEV_LONG_BITS + PICOEV_CTZL(v));
+	  if (i > maxfd) {
+	    break;
+	  }
+	  target = picoev.fds + i;
+	  revents = (PICOEV_FD_ISSET(i, &readfds) ? PICOEV_READ : 0)
+	    | (PICOEV_FD_ISSET(i, &writefds) ? PICOEV_WRITE : 0);
+	  if (revents != 0 && target->loop_id == loop->loop_id) {
+	    PICOEV_STATS_ADD(loop, events, 1);
+	    picoev_call_internal(loop, i, target, revents);
+	  }
 	}
       }
     }
@@ -167,3 +379,16 @@ int picoev_poll_once_internal(picoev_loop* loop, int max_wait)
   
   return 0;
 }
+
+#ifdef PICOEV_MULTI_BACKEND
+const picoev_backend picoev_select_backend = {
+  "select",
+  picoev_create_loop,
+  picoev_destroy_loop,
+  picoev_update_events_internal,
+  picoev_update_events_many_internal,
+  picoev_poll_once_internal,
+  picoev_signal_add,
+  picoev_signal_del
+};
+#endif